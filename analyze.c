@@ -0,0 +1,364 @@
+/*****************************************************************************
+* analyze.c: per frame quality metrics.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#include "common.h"
+#include "analyze.h"
+#include "picture.h"
+
+/* All metrics are over the luma of the cropped frame. PSNR and SSIM compare
+ * against the frame analysed before, which is the previous frame of the
+ * file only when every frame is analysed. */
+
+/* Bins in the histogram that is output, of 256 / ANALYZE_BINS levels each */
+#define ANALYZE_BINS 16
+/* A frame is black when this share of its samples is at or below the level */
+#define BLACK_LEVEL 32
+#define BLACK_SHARE 0.99
+/* A frame is flat when its luma standard deviation is below this */
+#define FLAT_STDDEV 2.0
+/* Identical frames */
+#define PSNR_MAX 100.0
+
+struct analyze_t {
+    FILE *fp;
+    int format;
+    int frame_cnt;
+    rect_t crop;
+    /* 8-bit luma of the current and previous frame, for high depth input */
+    uint8_t *luma8[2];
+    int cur;
+};
+
+typedef struct {
+    uint64_t sum, sqsum;
+    uint32_t hist[256];
+    uint64_t ssd;
+    double ssim;
+} frame_stats_t;
+
+/* Sum and sum of squares of a row */
+static void sum_sq_c(const uint8_t *p, int len, uint64_t *sum, uint64_t *sqsum)
+{
+    uint32_t s = 0;
+    uint64_t sq = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        s += p[i];
+        sq += p[i] * p[i];
+    }
+    *sum += s;
+    *sqsum += sq;
+}
+
+static uint64_t ssd_c(const uint8_t *a, const uint8_t *b, int len)
+{
+    uint64_t ssd = 0;
+    int i;
+
+    for (i = 0; i < len; i++)
+        ssd += (a[i] - b[i]) * (a[i] - b[i]);
+    return ssd;
+}
+
+#ifndef HAVE_SSE2
+/* s[0] sum a, s[1] sum b, s[2] sum a^2 + b^2, s[3] sum ab over an 8x8 block */
+static void ssim_8x8_c(const uint8_t *a, int stride_a, const uint8_t *b, int stride_b, uint32_t s[4])
+{
+    int x, y;
+
+    s[0] = s[1] = s[2] = s[3] = 0;
+    for (y = 0; y < 8; y++, a += stride_a, b += stride_b)
+        for (x = 0; x < 8; x++) {
+            s[0] += a[x];
+            s[1] += b[x];
+            s[2] += a[x] * a[x] + b[x] * b[x];
+            s[3] += a[x] * b[x];
+        }
+}
+#endif
+
+#ifdef HAVE_SSE2
+static inline uint32_t hsum_epi32(__m128i x)
+{
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(x);
+}
+
+/* The 32-bit accumulators are good for rows of up to 64K samples */
+static void sum_sq_sse2(const uint8_t *p, int len, uint64_t *sum, uint64_t *sqsum)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i s = zero, sq = zero;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i lo = _mm_unpacklo_epi8(x, zero);
+        __m128i hi = _mm_unpackhi_epi8(x, zero);
+        s = _mm_add_epi64(s, _mm_sad_epu8(x, zero));
+        sq = _mm_add_epi32(sq, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+    *sum += _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(s, s));
+    *sqsum += hsum_epi32(sq);
+
+    sum_sq_c(p + i, len - i, sum, sqsum);
+}
+
+static uint64_t ssd_sse2(const uint8_t *a, const uint8_t *b, int len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i ssd = zero;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(x, zero), _mm_unpacklo_epi8(y, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(x, zero), _mm_unpackhi_epi8(y, zero));
+        ssd = _mm_add_epi32(ssd, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+
+    return (uint64_t)hsum_epi32(ssd) + ssd_c(a + i, b + i, len - i);
+}
+
+static void ssim_8x8_sse2(const uint8_t *a, int stride_a, const uint8_t *b, int stride_b, uint32_t s[4])
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i s1 = zero, s2 = zero, ss = zero, s12 = zero;
+    int y;
+
+    for (y = 0; y < 8; y++, a += stride_a, b += stride_b) {
+        __m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)a), zero);
+        __m128i z = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)b), zero);
+        s1 = _mm_add_epi16(s1, x);
+        s2 = _mm_add_epi16(s2, z);
+        ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(x, x), _mm_madd_epi16(z, z)));
+        s12 = _mm_add_epi32(s12, _mm_madd_epi16(x, z));
+    }
+
+    s[0] = hsum_epi32(_mm_madd_epi16(s1, _mm_set1_epi16(1)));
+    s[1] = hsum_epi32(_mm_madd_epi16(s2, _mm_set1_epi16(1)));
+    s[2] = hsum_epi32(ss);
+    s[3] = hsum_epi32(s12);
+}
+
+#define sum_sq sum_sq_sse2
+#define ssd ssd_sse2
+#define ssim_8x8 ssim_8x8_sse2
+#else
+#define sum_sq sum_sq_c
+#define ssd ssd_c
+#define ssim_8x8 ssim_8x8_c
+#endif
+
+/* Four tables so that runs of equal samples don't serialise on one counter */
+static void histogram(const uint8_t *p, int len, uint32_t hist[4][256])
+{
+    int i;
+
+    for (i = 0; i + 4 <= len; i += 4) {
+        hist[0][p[i]]++;
+        hist[1][p[i + 1]]++;
+        hist[2][p[i + 2]]++;
+        hist[3][p[i + 3]]++;
+    }
+    for (; i < len; i++)
+        hist[0][p[i]]++;
+}
+
+/* Mean SSIM of the 8x8 blocks */
+static double ssim_plane(const uint8_t *a, int stride_a, const uint8_t *b, int stride_b, int width, int height)
+{
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    double total = 0;
+    uint32_t s[4];
+    int x, y, cnt = 0;
+
+    for (y = 0; y + 8 <= height; y += 8) {
+        for (x = 0; x + 8 <= width; x += 8) {
+            double mu1, mu2, var, covar;
+
+            ssim_8x8(a + y * stride_a + x, stride_a, b + y * stride_b + x, stride_b, s);
+            mu1 = s[0] / 64.0;
+            mu2 = s[1] / 64.0;
+            var = s[2] / 64.0 - mu1 * mu1 - mu2 * mu2;
+            covar = s[3] / 64.0 - mu1 * mu2;
+            total += (2 * mu1 * mu2 + c1) * (2 * covar + c2) / ((mu1 * mu1 + mu2 * mu2 + c1) * (var + c2));
+            cnt++;
+        }
+    }
+
+    return cnt ? total / cnt : 1.0;
+}
+
+int analyze_new(analyze_t **handle, config_t *config, int format, FILE *fp)
+{
+    analyze_t *a;
+    int i;
+
+    if ((a = calloc(1, sizeof(*a))) == NULL)
+        return -1;
+
+    a->fp = fp;
+    a->format = format;
+    a->crop = config->crop;
+
+    if (config->csp & COLORSPACE_HIGH_DEPTH) {
+        for (i = 0; i < 2; i++)
+            if ((a->luma8[i] = malloc((size_t)a->crop.width * a->crop.height)) == NULL) {
+                free(a->luma8[0]);
+                free(a);
+                return -1;
+            }
+    }
+
+    if (format == ANALYZE_CSV) {
+        fprintf(fp, "frame,mean,variance,min,max,black,flat,psnr,ssim");
+        for (i = 0; i < ANALYZE_BINS; i++)
+            fprintf(fp, ",h%d", i);
+        fprintf(fp, "\n");
+    } else {
+        fprintf(fp, "[\n");
+    }
+
+    *handle = a;
+    return 0;
+}
+
+int analyze_frame(analyze_t *a, picture_t *pic, picture_t *prev, int framenum)
+{
+    rect_t *crop = &a->crop;
+    int stride = pic->img.stride[0];
+    const uint8_t *luma = pic->img.plane[0] + crop->y * stride + crop->x;
+    uint32_t hist[4][256];
+    uint32_t bins[ANALYZE_BINS];
+    uint64_t sum = 0, sqsum = 0, err = 0, black = 0;
+    double n = (double)crop->width * crop->height;
+    double mean, variance, psnr = 0, ssim = 0;
+    int min = -1, max = 0;
+    int i, y;
+
+    /* The kernels are 8-bit, look at the top 8 bits of high depth samples.
+     * The previous frame was converted on the last call. */
+    if (a->luma8[0]) {
+        uint8_t *dst = a->luma8[a->cur];
+        luma = pic->img.plane[0] + crop->y * stride + crop->x * 2;
+        for (y = 0; y < crop->height; y++)
+            samples_pack8(dst + y * crop->width, luma + y * stride, crop->width);
+        luma = dst;
+        stride = crop->width;
+        a->cur = !a->cur;
+    }
+
+    memset(hist, 0, sizeof(hist));
+    memset(bins, 0, sizeof(bins));
+
+    for (y = 0; y < crop->height; y++) {
+        sum_sq(luma + y * stride, crop->width, &sum, &sqsum);
+        histogram(luma + y * stride, crop->width, hist);
+    }
+
+    for (i = 0; i < 256; i++) {
+        uint32_t cnt = hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i];
+        if (cnt && min < 0)
+            min = i;
+        if (cnt)
+            max = i;
+        if (i <= BLACK_LEVEL)
+            black += cnt;
+        bins[i * ANALYZE_BINS / 256] += cnt;
+    }
+
+    mean = sum / n;
+    variance = sqsum / n - mean * mean;
+
+    if (prev) {
+        int prev_stride = prev->img.stride[0];
+        const uint8_t *prev_luma = prev->img.plane[0] + crop->y * prev_stride + crop->x;
+
+        if (a->luma8[0]) {
+            prev_luma = a->luma8[a->cur];
+            prev_stride = crop->width;
+        }
+
+        for (y = 0; y < crop->height; y++)
+            err += ssd(luma + y * stride, prev_luma + y * prev_stride, crop->width);
+        psnr = err ? 10 * log10(255.0 * 255.0 * n / err) : PSNR_MAX;
+        if (psnr > PSNR_MAX)
+            psnr = PSNR_MAX;
+        ssim = ssim_plane(luma, stride, prev_luma, prev_stride, crop->width, crop->height);
+    }
+
+    if (a->format == ANALYZE_CSV) {
+        fprintf(a->fp, "%d,%.3f,%.3f,%d,%d,%d,%d,", framenum, mean, variance, min, max,
+                black >= BLACK_SHARE * n, variance < FLAT_STDDEV * FLAT_STDDEV);
+        if (prev)
+            fprintf(a->fp, "%.3f,%.5f", psnr, ssim);
+        else
+            fprintf(a->fp, ",");
+        for (i = 0; i < ANALYZE_BINS; i++)
+            fprintf(a->fp, ",%u", bins[i]);
+        fprintf(a->fp, "\n");
+    } else {
+        fprintf(a->fp, "%s  {\"frame\": %d, \"mean\": %.3f, \"variance\": %.3f, \"min\": %d, \"max\": %d, "
+                "\"black\": %s, \"flat\": %s, ", a->frame_cnt ? ",\n" : "", framenum, mean, variance, min, max,
+                black >= BLACK_SHARE * n ? "true" : "false",
+                variance < FLAT_STDDEV * FLAT_STDDEV ? "true" : "false");
+        if (prev)
+            fprintf(a->fp, "\"psnr\": %.3f, \"ssim\": %.5f, ", psnr, ssim);
+        else
+            fprintf(a->fp, "\"psnr\": null, \"ssim\": null, ");
+        fprintf(a->fp, "\"histogram\": [");
+        for (i = 0; i < ANALYZE_BINS; i++)
+            fprintf(a->fp, "%s%u", i ? ", " : "", bins[i]);
+        fprintf(a->fp, "]}");
+    }
+
+    a->frame_cnt++;
+    return ferror(a->fp) ? -1 : 0;
+}
+
+void analyze_free(analyze_t *a)
+{
+    if (!a)
+        return;
+    if (a->format == ANALYZE_JSON)
+        fprintf(a->fp, "%s]\n", a->frame_cnt ? "\n" : "");
+    fflush(a->fp);
+    free(a->luma8[0]);
+    free(a->luma8[1]);
+    free(a);
+}
@@ -0,0 +1,33 @@
+/*****************************************************************************
+* analyze.h: per frame quality metrics.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+enum {
+    ANALYZE_CSV = 1,
+    ANALYZE_JSON
+};
+
+typedef struct analyze_t analyze_t;
+
+int analyze_new(analyze_t **a, config_t *config, int format, FILE *fp);
+/* prev is the frame analysed before, NULL for the first one */
+int analyze_frame(analyze_t *a, picture_t *pic, picture_t *prev, int framenum);
+void analyze_free(analyze_t *a);
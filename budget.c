@@ -0,0 +1,182 @@
+/*****************************************************************************
+* budget.c: latency budgeted compression control.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "output.h"
+#include "budget.h"
+#include "output/pngfilter.h"
+
+/* Each frame gets the step of the ladder that is expected to encode within
+ * the budget and make the smallest file. Expectations are a moving average
+ * of the encode time per pixel, kept relative to the first step so a
+ * measurement on any step updates the rest. */
+
+static const struct {
+    int zlevel, strategy, filter;
+    double cost;                /* relative encode time until measured */
+} ladder[] = {
+    { 1, Z_RLE, PNGF_UP, 1.0 },
+    { 2, Z_FILTERED, PNGF_UP, 1.5 },
+    { 3, Z_FILTERED, OUTPUT_FILTER_ADAPTIVE, 2.5 },
+    { 6, Z_FILTERED, OUTPUT_FILTER_ADAPTIVE, 4.0 },
+    { 6, Z_DEFAULT_STRATEGY, OUTPUT_FILTER_ADAPTIVE, 5.0 },
+    { 9, Z_DEFAULT_STRATEGY, OUTPUT_FILTER_ADAPTIVE, 12.0 },
+};
+
+#define LADDER_STEPS (sizeof(ladder) / sizeof(*ladder))
+/* Weight of the newest measurement in the averages */
+#define BUDGET_ALPHA 0.25
+/* Share of the budget a prediction may use, encode times are noisy */
+#define BUDGET_HEADROOM 0.85
+/* Every this many frames the next slower step is tried if it should fit */
+#define BUDGET_PROBE 8
+
+typedef struct {
+    double cost;                /* ns per pixel over that of step 0 */
+    double bytes;               /* per pixel */
+    int64_t frames;
+} step_t;
+
+struct budget_t {
+    int64_t ns;
+    double ns_pixel;            /* of step 0 */
+    int cur;
+    step_t steps[LADDER_STEPS];
+
+    int64_t frames, over;
+    int64_t total_ns, total_bytes;
+};
+
+int budget_new(budget_t **handle, int64_t ns)
+{
+    budget_t *b;
+    int i;
+
+    if ((b = calloc(1, sizeof(*b))) == NULL)
+        return -1;
+
+    b->ns = ns;
+    for (i = 0; i < LADDER_STEPS; i++)
+        b->steps[i].cost = ladder[i].cost;
+
+    *handle = b;
+    return 0;
+}
+
+static int fits(budget_t *b, int step, int64_t pixels)
+{
+    return b->ns_pixel * b->steps[step].cost * pixels <= b->ns * BUDGET_HEADROOM;
+}
+
+void budget_choose(budget_t *b, output_param_t *param, int64_t pixels)
+{
+    int i, best = -1, slowest = 0;
+
+    /* Nothing measured yet, start in the middle */
+    if (b->frames == 0) {
+        b->cur = LADDER_STEPS / 2;
+    } else {
+        /* Of the measured steps that fit, the one making the smallest
+         * files, the faster one on a tie */
+        for (i = 0; i < LADDER_STEPS; i++) {
+            if (!fits(b, i, pixels))
+                continue;
+            slowest = i;
+            if (b->steps[i].frames && (best < 0 || b->steps[i].bytes < b->steps[best].bytes))
+                best = i;
+        }
+        if (best < 0)
+            best = slowest;
+
+        /* The bytes of a step are only known once it has been tried */
+        if (b->frames % BUDGET_PROBE == 0 && best + 1 < LADDER_STEPS && fits(b, best + 1, pixels))
+            best++;
+        b->cur = best;
+    }
+
+    param->zlevel = ladder[b->cur].zlevel;
+    param->strategy = ladder[b->cur].strategy;
+    param->filter = ladder[b->cur].filter;
+}
+
+void budget_update(budget_t *b, int64_t ns, int64_t bytes, int64_t pixels)
+{
+    step_t *s = &b->steps[b->cur];
+    double ns_pixel = (double)ns / pixels;
+
+    if (b->frames == 0) {
+        b->ns_pixel = ns_pixel / s->cost;
+    } else {
+        /* Split the surprise between the step and the overall speed */
+        b->ns_pixel += BUDGET_ALPHA * (ns_pixel / s->cost - b->ns_pixel);
+        if (b->cur)
+            s->cost += BUDGET_ALPHA * (ns_pixel / b->ns_pixel - s->cost);
+    }
+
+    if (s->frames == 0)
+        s->bytes = (double)bytes / pixels;
+    else
+        s->bytes += BUDGET_ALPHA * ((double)bytes / pixels - s->bytes);
+    s->frames++;
+
+    b->frames++;
+    b->over += ns > b->ns;
+    b->total_ns += ns;
+    b->total_bytes += bytes;
+}
+
+void budget_report(budget_t *b, const char *name, FILE *fp)
+{
+    static const char *strategies[] = {
+        [Z_DEFAULT_STRATEGY] = "default", [Z_FILTERED] = "filtered", [Z_RLE] = "rle",
+    };
+    static const char *filters[] = {
+        [PNGF_NONE] = "none", [PNGF_UP] = "up", [OUTPUT_FILTER_ADAPTIVE] = "adaptive",
+    };
+    int i;
+
+    if (b->frames == 0)
+        return;
+
+    fprintf(fp, "budget: %s: %"PRId64" frames, %.2f ms average against %.2f ms, %"PRId64" over, %"PRId64" bytes\n",
+            name, b->frames, b->total_ns / 1e6 / b->frames, b->ns / 1e6, b->over, b->total_bytes);
+    for (i = 0; i < LADDER_STEPS; i++) {
+        step_t *s = &b->steps[i];
+        if (s->frames == 0)
+            continue;
+        fprintf(fp, "budget:   z%d %-8s %-8s %6"PRId64" frames, %.2f ns/pixel, %.3f bytes/pixel\n",
+                ladder[i].zlevel, strategies[ladder[i].strategy], filters[ladder[i].filter],
+                s->frames, b->ns_pixel * s->cost, s->bytes);
+    }
+}
+
+void budget_free(budget_t *b)
+{
+    free(b);
+}
@@ -0,0 +1,32 @@
+/*****************************************************************************
+* budget.h: latency budgeted compression control.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+typedef struct budget_t budget_t;
+
+/* ns is the wall time allowed for encoding each frame */
+int budget_new(budget_t **b, int64_t ns);
+/* Compression settings for the next frame of pixels */
+void budget_choose(budget_t *b, output_param_t *param, int64_t pixels);
+/* What encoding it with them took */
+void budget_update(budget_t *b, int64_t ns, int64_t bytes, int64_t pixels);
+void budget_report(budget_t *b, const char *name, FILE *fp);
+void budget_free(budget_t *b);
@@ -0,0 +1,300 @@
+/*****************************************************************************
+* cache.c: incremental output cache.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cache.h"
+
+/* The manifest is a plain text file in the output directory, one line per
+ * output image:
+ *
+ *   <name> <key> <size> <mtime sec> <mtime nsec>
+ *
+ * key is a hash of the source file identity, the frame number and the output
+ * options. An output is up to date when its key matches and the file on disk
+ * still has the recorded size and mtime, so checking it costs one stat(). */
+
+#define CACHE_MAGIC "frameshot-cache 1"
+
+typedef struct {
+    char name[NAME_MAX + 1];
+    uint64_t name_hash;
+    uint64_t key;
+    int64_t size;
+    int64_t mtime_sec;
+    long mtime_nsec;
+} cache_entry_t;
+
+struct cache_t {
+    char *outdir;
+    uint64_t source;
+    int dirty;
+    int entry_cnt;
+    int entry_max;
+    cache_entry_t *entries;
+    /* Open addressed index into entries by name_hash, -1 when empty. Twice
+     * entry_max, so it is never more than half full. */
+    int *slots;
+};
+
+/* 64-bit FNV-1a, the inputs are all short */
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+/* The slot holding name, or the empty one it would go in */
+static int *find_slot(cache_t *c, const char *name, uint64_t name_hash)
+{
+    int mask = 2 * c->entry_max - 1;
+    int i = name_hash & mask;
+
+    while (c->slots[i] >= 0) {
+        cache_entry_t *e = &c->entries[c->slots[i]];
+        if (e->name_hash == name_hash && !strcmp(e->name, name))
+            break;
+        i = (i + 1) & mask;
+    }
+    return &c->slots[i];
+}
+
+static cache_entry_t *find_entry(cache_t *c, const char *name, uint64_t name_hash)
+{
+    int *slot;
+
+    if (c->entry_cnt == 0)
+        return NULL;
+    slot = find_slot(c, name, name_hash);
+    return *slot < 0 ? NULL : &c->entries[*slot];
+}
+
+static cache_entry_t *add_entry(cache_t *c, const char *name, uint64_t name_hash)
+{
+    cache_entry_t *e;
+    int i;
+
+    if (c->entry_cnt == c->entry_max) {
+        int max = c->entry_max ? 2 * c->entry_max : 256;
+        int *slots = malloc(2 * max * sizeof(*slots));
+        if (slots == NULL)
+            return NULL;
+        e = realloc(c->entries, max * sizeof(*e));
+        if (e == NULL) {
+            free(slots);
+            return NULL;
+        }
+        c->entries = e;
+        c->entry_max = max;
+        free(c->slots);
+        c->slots = slots;
+        memset(c->slots, -1, 2 * max * sizeof(*slots));
+        for (i = 0; i < c->entry_cnt; i++)
+            *find_slot(c, c->entries[i].name, c->entries[i].name_hash) = i;
+    }
+
+    *find_slot(c, name, name_hash) = c->entry_cnt;
+    e = &c->entries[c->entry_cnt++];
+    memset(e, 0, sizeof(*e));
+    strncpy(e->name, name, NAME_MAX);
+    e->name_hash = name_hash;
+    return e;
+}
+
+static void read_manifest(cache_t *c)
+{
+    char path[PATH_MAX];
+    char line[NAME_MAX + 128];
+    char name[NAME_MAX + 1];
+    cache_entry_t *e;
+    uint64_t key, name_hash;
+    int64_t size, sec;
+    long nsec;
+    FILE *fp;
+
+    snprintf(path, PATH_MAX, "%s/%s", c->outdir, CACHE_MANIFEST);
+    if ((fp = fopen(path, "r")) == NULL)
+        return;
+
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, CACHE_MAGIC, strlen(CACHE_MAGIC))) {
+        fprintf(stderr, "warning: ignoring unrecognised cache manifest '%s'\n", path);
+        fclose(fp);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%255s %" SCNx64 " %" SCNd64 " %" SCNd64 " %ld",
+                   name, &key, &size, &sec, &nsec) != 5)
+            continue;
+        name_hash = hash_bytes(HASH_INIT, name, strlen(name));
+        if ((e = find_entry(c, name, name_hash)) == NULL
+            && (e = add_entry(c, name, name_hash)) == NULL)
+            break;
+        e->key = key;
+        e->size = size;
+        e->mtime_sec = sec;
+        e->mtime_nsec = nsec;
+    }
+
+    fclose(fp);
+}
+
+static int write_manifest(cache_t *c)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct stat sb;
+    FILE *fp;
+    int i;
+
+    snprintf(path, PATH_MAX, "%s/%s", c->outdir, CACHE_MANIFEST);
+    snprintf(tmp, PATH_MAX, "%s.tmp", path);
+
+    if ((fp = fopen(tmp, "w")) == NULL)
+        return -1;
+
+    fprintf(fp, "%s\n", CACHE_MAGIC);
+    for (i = 0; i < c->entry_cnt; i++) {
+        cache_entry_t *e = &c->entries[i];
+
+        /* Outputs deleted since they were written */
+        snprintf(path, PATH_MAX, "%s/%s", c->outdir, e->name);
+        if (stat(path, &sb) < 0)
+            continue;
+        fprintf(fp, "%s %016" PRIx64 " %" PRId64 " %" PRId64 " %ld\n",
+                e->name, e->key, e->size, e->mtime_sec, e->mtime_nsec);
+    }
+
+    snprintf(path, PATH_MAX, "%s/%s", c->outdir, CACHE_MANIFEST);
+    if (fclose(fp) || rename(tmp, path)) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+int cache_open(char *outdir, char *infile, cache_t **cache)
+{
+    struct stat sb;
+    cache_t *c;
+
+    /* A pipe has no stable identity to key on */
+    if (!strcmp(infile, "-") || stat(infile, &sb) < 0 || !S_ISREG(sb.st_mode))
+        return -1;
+
+    if ((c = calloc(1, sizeof(*c))) == NULL)
+        return -1;
+
+    c->outdir = strdup(outdir);
+    c->source = HASH_INIT;
+    c->source = hash_bytes(c->source, &sb.st_dev, sizeof(sb.st_dev));
+    c->source = hash_bytes(c->source, &sb.st_ino, sizeof(sb.st_ino));
+    c->source = hash_bytes(c->source, &sb.st_size, sizeof(sb.st_size));
+    c->source = hash_bytes(c->source, &sb.st_mtim, sizeof(sb.st_mtim));
+
+    read_manifest(c);
+
+    *cache = c;
+    return 0;
+}
+
+uint64_t cache_key(cache_t *c, int framenum, const char *params)
+{
+    uint64_t h = c->source;
+    h = hash_bytes(h, &framenum, sizeof(framenum));
+    h = hash_bytes(h, params, strlen(params));
+    return h;
+}
+
+int cache_lookup(cache_t *c, const char *name, uint64_t key)
+{
+    char path[PATH_MAX];
+    struct stat sb;
+    cache_entry_t *e;
+
+    e = find_entry(c, name, hash_bytes(HASH_INIT, name, strlen(name)));
+    if (e == NULL || e->key != key)
+        return 0;
+
+    snprintf(path, PATH_MAX, "%s/%s", c->outdir, name);
+    if (stat(path, &sb) < 0)
+        return 0;
+
+    return sb.st_size == e->size && sb.st_mtim.tv_sec == e->mtime_sec
+           && sb.st_mtim.tv_nsec == e->mtime_nsec;
+}
+
+int cache_update(cache_t *c, const char *name, uint64_t key)
+{
+    char path[PATH_MAX];
+    struct stat sb;
+    uint64_t name_hash = hash_bytes(HASH_INIT, name, strlen(name));
+    cache_entry_t *e;
+
+    snprintf(path, PATH_MAX, "%s/%s", c->outdir, name);
+    if (stat(path, &sb) < 0)
+        return -1;
+
+    if ((e = find_entry(c, name, name_hash)) == NULL
+        && (e = add_entry(c, name, name_hash)) == NULL)
+        return -1;
+
+    e->key = key;
+    e->size = sb.st_size;
+    e->mtime_sec = sb.st_mtim.tv_sec;
+    e->mtime_nsec = sb.st_mtim.tv_nsec;
+    c->dirty = 1;
+
+    return 0;
+}
+
+int cache_close(cache_t *c)
+{
+    int ret = 0;
+
+    if (!c)
+        return 0;
+
+    if (c->dirty && (ret = write_manifest(c)))
+        fprintf(stderr, "warning: could not write cache manifest\n");
+
+    free(c->entries);
+    free(c->slots);
+    free(c->outdir);
+    free(c);
+
+    return ret;
+}
@@ -0,0 +1,31 @@
+/*****************************************************************************
+* cache.h: incremental output cache.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#define CACHE_MANIFEST ".frameshot-cache"
+
+typedef struct cache_t cache_t;
+
+int cache_open(char *outdir, char *infile, cache_t **cache);
+uint64_t cache_key(cache_t *cache, int framenum, const char *params);
+int cache_lookup(cache_t *cache, const char *name, uint64_t key);
+int cache_update(cache_t *cache, const char *name, uint64_t key);
+int cache_close(cache_t *cache);
@@ -26,23 +26,54 @@ enum {
     COLORSPACE_420,
     COLORSPACE_422,
     COLORSPACE_444,
-    COLORSPACE_444A
+    COLORSPACE_444A,
+    /* Luma only */
+    COLORSPACE_400,
+    /* Packed RGB, only produced internally */
+    COLORSPACE_RGB,
+    COLORSPACE_RGBA
 };
 
+/* Or'ed into any of the above: 16-bit samples. Planar ones are little endian
+ * and MSB aligned whatever the source depth, packed ones big endian. */
+#define COLORSPACE_HIGH_DEPTH 0x100
+#define COLORSPACE_MASK 0xff
+
 typedef void *handle_t;
 
+typedef struct {
+    uint32_t x, y;
+    uint32_t width, height;
+} rect_t;
+
 typedef struct {
     int plane_cnt;
     int stride[4];
     uint8_t *plane[4];
 } image_t;
 
+/* Where a frame's bytes are stored, uncompressed, in the input file */
+typedef struct {
+    int fd;                 /* -1 when they aren't */
+    int64_t offset;
+    int64_t size;
+} frame_ref_t;
+
 typedef struct {
     /* pts of picture */
     int64_t pts;
 
     /* In: raw data */
     image_t img;
+
+    /* In: region that will be used, readers may leave the rest untouched */
+    rect_t roi;
+
+    /* Out: the source of the frame, for drivers that copy it untouched */
+    frame_ref_t ref;
+
+    /* Private: pool the picture is returned to */
+    void *pool;
 } picture_t;
 
 typedef struct
@@ -50,5 +81,21 @@ typedef struct
     uint32_t width, height;
     int frame_cnt;
     int csp;
+    /* Of the source samples, 8 unless csp has COLORSPACE_HIGH_DEPTH */
+    int bit_depth;
+    /* 0 when unknown */
+    int fps_num, fps_den;
+    int sar_width, sar_height;
+    /* y4m C tag of 8-bit 4:2:0 input and I tag, NULL and 0 when unknown */
+    const char *chroma_siting;
+    char interlace;
+    /* Set before the input is opened when only luma is wanted */
+    int luma_only;
+    /* The input fills in picture_t ref */
+    int frame_refs;
+    /* Decoder threads, 0 for one per core */
+    int threads;
+    /* Region of the frame that is output */
+    rect_t crop;
     uint32_t frames[MAX_FRAMES];
 } config_t;
@@ -22,6 +22,7 @@
 *****************************************************************************/
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -29,8 +30,17 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 
 #include <zlib.h>
+#include <libavutil/avutil.h>
+#include <libswscale/swscale.h>
 
 
 #define _GNU_SOURCE
@@ -40,6 +50,12 @@
 #include "utils.h"
 #include "output.h"
 #include "input.h"
+#include "cache.h"
+#include "sheet.h"
+#include "analyze.h"
+#include "budget.h"
+#include "hash.h"
+#include "picture.h"
 
 enum {
     FORMAT_UNKNOWN,
@@ -49,10 +65,72 @@ enum {
     FORMAT_M4V
 };
 
+#define MAX_RENDITIONS 8
+/* Frames read ahead looking for one that isn't black with --crop auto */
+#define MAX_LOOKAHEAD 8
+/* Distinct frames kept to compare against with --dedup, the oldest goes */
+#define MAX_SEEN 16
+/* Rendition compression level that follows -z */
+#define ZLEVEL_INHERIT -2
+/* Rendition JPEG quality that follows -q */
+#define QUALITY_INHERIT -1
+
+typedef struct {
+    int width;              /* 0 keeps the (cropped) source size */
+    const output_driver_t *output;
+    output_param_t param;
+    char params[128];
+
+    /* Geometry and scaled planes, set up once the crop is known */
+    config_t config;
+    picture_t *pic;
+    struct SwsContext *sws;
+    /* Open for the whole run with OUTPUT_STREAM drivers */
+    handle_t hout;
+    /* Picks the compression of each frame with --budget */
+    budget_t *budget;
+
+    /* Current frame */
+    char name[NAME_MAX + 1];
+    char path[PATH_MAX];
+    uint64_t key;
+    int stale;
+    int ret;
+    pthread_t thread;
+} rendition_t;
+
+/* A frame whose outputs have been written, for --dedup. A matching hash
+ * only makes a candidate, the samples are compared before reuse. */
 typedef struct {
+    uint64_t hash;
+    int framenum;
+    picture_t *pic;         /* the cropped samples */
+} seen_frame_t;
+
+typedef struct {
+    char *infile;
     char *outdir;
     int zlevel;
+    int quality;
+    int64_t budget_ns;
+    int64_t budget_frames, budget_over, budget_total_ns;
+    const output_driver_t *output;
+    int incremental;
+    int analyze;
+    int crop_auto;
+    int sheet_columns;
+    int tile_width;
+    int rendition_cnt;
+    int renditions_ready;
+    rendition_t renditions[MAX_RENDITIONS];
     handle_t hin;
+    cache_t *cache;
+    int dedup;
+    int seen_cnt, reused_cnt;
+    seen_frame_t seen[MAX_SEEN];
+    int ahead_cnt;
+    picture_t *ahead[MAX_LOOKAHEAD];
+    int ahead_frame[MAX_LOOKAHEAD];
 } cli_opt_t;
 
 /* input file function pointers */
@@ -60,14 +138,10 @@ int (*open_infile) (char *filename, handle_t *handle, config_t *config);
 int (*read_frame) (handle_t handle, picture_t *pic, int framenum);
 int (*close_infile) (handle_t handle);
 
-/* output file function pointers */
-static int (*open_outfile) (char *filename, handle_t *handle, int compression);
-// static int (*set_outfile_param) (handle_t handle, config_t *config);
-static int (*write_image) (handle_t handle, picture_t *pic, config_t *config);
-static int (*close_outfile) (handle_t handle);
-
 static int parse_options(int argc, char **argv, config_t *config, cli_opt_t *opt);
 static int grab_frames(config_t *config, cli_opt_t *opt);
+static int grab_analysis(config_t *config, cli_opt_t *opt);
+static int detect_letterbox(picture_t *pic, config_t *config);
 
 int main(int argc, char **argv)
 {
@@ -75,20 +149,29 @@ int main(int argc, char **argv)
     cli_opt_t opt;
     int ret = 0;
 
-    parse_options(argc, argv, &config, &opt);
+    if (parse_options(argc, argv, &config, &opt))
+        return -1;
+
+    if (opt.analyze)
+        ret = grab_analysis(&config, &opt);
+    else
+        ret = grab_frames(&config, &opt);
 
-    ret = grab_frames(&config, &opt);
+    picture_pool_flush();
+    output_pool_flush();
 
     return ret;
 }
 
 static void show_help(void)
 {
+    int i;
+
 #define HELP printf
     HELP("Syntax: frameshot [options] infile\n"
          "\n"
          "Infile is a raw bitstream of one of the following codecs:\n"
-         "  YUV4MPEG(*.y4m), Dirac(*.drc)\n"
+         "  YUV4MPEG(*.y4m, *.y4m.gz), Dirac(*.drc)\n"
          "\n"
          "Options:\n"
          "\n"
@@ -99,19 +182,104 @@ static void show_help(void)
     HELP("  -z, --compression <integer> Ammount of compression to use.\n");
     HELP("  -1, --fast                  Use fastest compression.\n");
     HELP("  -9, --best                  Use best (slowest) compression.\n");
+    HELP("  -q, --quality <integer>     JPEG quality, 1-100 [%d].\n", JPEG_DEFAULT_QUALITY);
+    HELP("  -b, --budget <float>        Encode time allowed per frame in ms, shared\n"
+         "                              by the renditions. PNG compression is\n"
+         "                              adjusted every frame to make the smallest\n"
+         "                              files that fit.\n");
+    HELP("  -p, --throughput <float>    Frames per second, the same as a budget\n"
+         "                              of 1000 / fps ms.\n");
+    HELP("  -i, --incremental           Skip outputs that are already up to date.\n");
+    HELP("  -F, --format <string>       Output image format [%s].\n", output_drivers[0]->name);
+    for (i = 0; output_drivers[i]; i++)
+        HELP("%s%s", i ? ", " : "                              One of: ", output_drivers[i]->name);
+    HELP("\n");
+    HELP("  -r, --rendition <width|full>[:<format>[:<integer>|q<integer>]]\n"
+         "                              Add an output rendition scaled to width,\n"
+         "                              with its own compression or JPEG quality.\n"
+         "                              Repeatable.\n");
+    HELP("  -s, --sheet <integer>       Tile all frames onto one contact sheet\n"
+         "                              with this many columns.\n");
+    HELP("  -t, --tile-width <integer>  Width of contact sheet tiles [%d].\n", SHEET_TILE_WIDTH);
+    HELP("  -T, --threads <integer>     Decoder threads, 0 for one per core [0].\n");
+    HELP("  -a, --analyze <csv|json>    Write per frame luma statistics, PSNR and\n"
+         "                              SSIM to stdout instead of images. Every\n"
+         "                              frame unless --frames is given.\n");
+    HELP("  -c, --crop <WxH+X+Y|auto>   Only output a region of the frame.\n"
+         "                              'auto' strips letterboxing.\n");
+    HELP("  -d, --dedup                 Hardlink the images of a frame identical\n"
+         "                              to one of the last %d written instead of\n"
+         "                              encoding.\n", MAX_SEEN);
+    HELP("  -g, --gray                  Luma only: chroma is never read or\n"
+         "                              converted, PNGs are grayscale.\n");
     HELP("\n");
 }
 
+static int parse_rendition(char *arg, rendition_t *r)
+{
+    char *format, *level;
+
+    memset(r, 0, sizeof(*r));
+    r->param.zlevel = ZLEVEL_INHERIT;
+    r->param.quality = QUALITY_INHERIT;
+
+    if ((format = strchr(arg, ':')) != NULL) {
+        *format++ = 0;
+        if ((level = strchr(format, ':')) != NULL) {
+            *level++ = 0;
+            if (level[0] == 'q' && level[1] >= '0' && level[1] <= '9') {
+                r->param.quality = atoi(level + 1);
+                if (r->param.quality < 1 || r->param.quality > 100) {
+                    fprintf(stderr, "ERROR: Invalid rendition JPEG quality '%s'.\n", level);
+                    return -1;
+                }
+            } else if (level[0] >= '0' && level[0] <= '9') {
+                r->param.zlevel = atoi(level);
+            } else {
+                fprintf(stderr, "ERROR: Invalid rendition compression '%s'.\n", level);
+                return -1;
+            }
+        }
+        if (*format && (r->output = output_find(format)) == NULL) {
+            fprintf(stderr, "ERROR: Unknown rendition format '%s'.\n", format);
+            return -1;
+        }
+    }
+
+    if (strcasecmp(arg, "full")) {
+        r->width = atoi(arg) & ~1;
+        if (r->width < 2) {
+            fprintf(stderr, "ERROR: Invalid rendition width '%s'.\n", arg);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int rendition_cmp(const void *p1, const void *p2)
+{
+    const rendition_t *r1 = p1, *r2 = p2;
+    unsigned w1 = r1->width ? r1->width : UINT_MAX;
+    unsigned w2 = r2->width ? r2->width : UINT_MAX;
+    return w1 < w2 ? 1 : w1 > w2 ? -1 : 0;
+}
+
 static int parse_options(int argc, char **argv, config_t *config, cli_opt_t *opt)
 {
     char *filename = NULL;
-    int zlevel = Z_DEFAULT_COMPRESSION;
     char *file_ext, *token;
+    double v, ns;
+    int i;
     int is_y4m = 0;
     int is_dirac = 0;
     struct stat sb;
 
     memset(opt, 0, sizeof(*opt));
+    memset(config, 0, sizeof(*config));
+    opt->zlevel = Z_DEFAULT_COMPRESSION;
+    opt->quality = JPEG_DEFAULT_QUALITY;
+    opt->tile_width = SHEET_TILE_WIDTH;
 
     /* Default input driver */
     open_infile = open_file_y4m;
@@ -119,23 +287,34 @@ static int parse_options(int argc, char **argv, config_t *config, cli_opt_t *opt
     close_infile = close_file_y4m;
 
     /* Default output driver */
-    open_outfile = open_file_png;
-    write_image = write_image_png;
-    close_outfile = close_file_png;
+    opt->output = output_drivers[0];
 
     for (;;) {
         int long_options_index = -1;
         static struct option long_options[] = {
             {"fast", no_argument, NULL, '1'},
+            {"analyze", required_argument, NULL, 'a'},
             {"best", no_argument, NULL, '9'},
+            {"budget", required_argument, NULL, 'b'},
+            {"crop", required_argument, NULL, 'c'},
+            {"dedup", no_argument, NULL, 'd'},
+            {"format", required_argument, NULL, 'F'},
             {"frames", required_argument, NULL, 'f'},
+            {"gray", no_argument, NULL, 'g'},
             {"help", no_argument, NULL, 'h'},
+            {"incremental", no_argument, NULL, 'i'},
             {"outdir", required_argument, NULL, 'o'},
+            {"quality", required_argument, NULL, 'q'},
+            {"throughput", required_argument, NULL, 'p'},
             {"compression", required_argument, NULL, 'z'},
+            {"rendition", required_argument, NULL, 'r'},
+            {"sheet", required_argument, NULL, 's'},
+            {"tile-width", required_argument, NULL, 't'},
+            {"threads", required_argument, NULL, 'T'},
             {0, 0, 0, 0}
         };
 
-        int c = getopt_long(argc, argv, "19f:ho:z:", long_options, &long_options_index);
+        int c = getopt_long(argc, argv, "19a:b:c:dF:f:ghio:p:q:r:s:T:t:z:", long_options, &long_options_index);
 
         if (c == -1) {
             break;
@@ -143,10 +322,49 @@ static int parse_options(int argc, char **argv, config_t *config, cli_opt_t *opt
 
         switch (c) {
             case '1':
-                zlevel = Z_BEST_SPEED;
+                opt->zlevel = Z_BEST_SPEED;
                 break;
             case '9':
-                zlevel = Z_BEST_COMPRESSION;
+                opt->zlevel = Z_BEST_COMPRESSION;
+                break;
+            case 'a':
+                if (!strcasecmp(optarg, "csv")) {
+                    opt->analyze = ANALYZE_CSV;
+                } else if (!strcasecmp(optarg, "json")) {
+                    opt->analyze = ANALYZE_JSON;
+                } else {
+                    fprintf(stderr, "ERROR: Unknown analysis format '%s'.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'b':
+            case 'p':
+                v = atof(optarg);
+                ns = c == 'b' ? v * 1e6 : 1e9 / v;
+                /* Also NaN, and anything that doesn't fit the nanoseconds */
+                if (!(v > 0) || !(ns >= 1 && ns < 1e18)) {
+                    fprintf(stderr, "ERROR: Invalid %s '%s'.\n", c == 'b' ? "budget" : "throughput", optarg);
+                    return -1;
+                }
+                opt->budget_ns = ns;
+                break;
+            case 'c':
+                if (!strcmp(optarg, "auto")) {
+                    opt->crop_auto = 1;
+                } else if (sscanf(optarg, "%ux%u+%u+%u", &config->crop.width, &config->crop.height,
+                                  &config->crop.x, &config->crop.y) != 4) {
+                    fprintf(stderr, "ERROR: Invalid crop '%s', expected WxH+X+Y.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'd':
+                opt->dedup = 1;
+                break;
+            case 'F':
+                if ((opt->output = output_find(optarg)) == NULL) {
+                    fprintf(stderr, "ERROR: Unknown output format '%s'.\n", optarg);
+                    return -1;
+                }
                 break;
             case 'f':
                 for (config->frame_cnt = 0; config->frame_cnt < MAX_FRAMES; config->frame_cnt++, optarg = NULL) {
@@ -157,6 +375,12 @@ static int parse_options(int argc, char **argv, config_t *config, cli_opt_t *opt
                 }
                 qsort(config->frames, config->frame_cnt, sizeof(*config->frames), intcmp);
                 break;
+            case 'g':
+                config->luma_only = 1;
+                break;
+            case 'i':
+                opt->incremental = 1;
+                break;
             case 'o':
                 opt->outdir = strdup(optarg);
                 if (stat(opt->outdir, &sb) < 0) {
@@ -172,6 +396,42 @@ static int parse_options(int argc, char **argv, config_t *config, cli_opt_t *opt
                     }
                 }
                 break;
+            case 'q':
+                opt->quality = atoi(optarg);
+                if (opt->quality < 1 || opt->quality > 100) {
+                    fprintf(stderr, "ERROR: Invalid JPEG quality '%s'.\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'r':
+                if (opt->rendition_cnt == MAX_RENDITIONS) {
+                    fprintf(stderr, "ERROR: At most %d renditions.\n", MAX_RENDITIONS);
+                    return -1;
+                }
+                if (parse_rendition(optarg, &opt->renditions[opt->rendition_cnt++]))
+                    return -1;
+                break;
+            case 's':
+                opt->sheet_columns = atoi(optarg);
+                if (opt->sheet_columns < 1) {
+                    fprintf(stderr, "ERROR: Invalid number of sheet columns.\n");
+                    return -1;
+                }
+                break;
+            case 't':
+                opt->tile_width = atoi(optarg);
+                if (opt->tile_width < 2) {
+                    fprintf(stderr, "ERROR: Invalid tile width.\n");
+                    return -1;
+                }
+                break;
+            case 'T':
+                if (optarg[0] < '0' || optarg[0] > '9') {
+                    fprintf(stderr, "ERROR: Invalid number of threads.\n");
+                    return -1;
+                }
+                config->threads = atoi(optarg);
+                break;
             case 'z':
                 if (optarg == NULL || optarg[0] < '0' || optarg[0] > '9') {
                     opt->zlevel = Z_DEFAULT_COMPRESSION;
@@ -186,23 +446,67 @@ static int parse_options(int argc, char **argv, config_t *config, cli_opt_t *opt
         }
     }
 
+    if (opt->sheet_columns && opt->rendition_cnt) {
+        fprintf(stderr, "ERROR: Renditions can't be combined with a contact sheet.\n");
+        return -1;
+    }
+    if (opt->sheet_columns && opt->budget_ns)
+        fprintf(stderr, "warning: contact sheets ignore the budget\n");
+
+    /* A single full size rendition by default */
+    if (opt->rendition_cnt == 0)
+        opt->renditions[opt->rendition_cnt++].param.zlevel = ZLEVEL_INHERIT;
+    for (i = 0; i < opt->rendition_cnt; i++) {
+        int j;
+        if (opt->renditions[i].param.zlevel == ZLEVEL_INHERIT)
+            opt->renditions[i].param.zlevel = opt->zlevel;
+        if (opt->renditions[i].param.quality == QUALITY_INHERIT)
+            opt->renditions[i].param.quality = opt->quality;
+        if (opt->renditions[i].output == NULL)
+            opt->renditions[i].output = opt->output;
+        /* The file name is made of these, two such would write one file */
+        for (j = 0; j < i; j++) {
+            if (opt->renditions[j].width == opt->renditions[i].width
+                && !strcmp(opt->renditions[j].output->ext, opt->renditions[i].output->ext)) {
+                if (opt->renditions[i].width)
+                    fprintf(stderr, "ERROR: Duplicate %dw %s rendition.\n", opt->renditions[i].width,
+                            opt->renditions[i].output->ext);
+                else
+                    fprintf(stderr, "ERROR: Duplicate full size %s rendition.\n", opt->renditions[i].output->ext);
+                return -1;
+            }
+        }
+        opt->renditions[i].param.strategy = OUTPUT_STRATEGY_AUTO;
+        opt->renditions[i].param.filter = OUTPUT_FILTER_AUTO;
+        if (opt->budget_ns && !opt->sheet_columns) {
+            if (!(opt->renditions[i].output->flags & OUTPUT_TUNABLE))
+                fprintf(stderr, "warning: %s output ignores the budget\n", opt->renditions[i].output->name);
+        }
+    }
+    /* Largest first, each one is scaled from the one before */
+    qsort(opt->renditions, opt->rendition_cnt, sizeof(*opt->renditions), rendition_cmp);
+
     /* Get the input file name */
     if (optind > argc - 1) {
         fprintf(stderr, "ERROR: No input file.\n");
         show_help();
         return -1;
     }
-    filename = argv[optind++];
+    filename = opt->infile = argv[optind++];
 
     file_ext = strrchr(filename, '.');
-    if (!strncasecmp(file_ext, ".y4m", 4))
+    if (file_ext && (!strncasecmp(file_ext, ".y4m", 4) || !strncasecmp(file_ext, ".gz", 3)))
         is_y4m = 1;
-    else if (!strncasecmp(file_ext, ".drc", 4))
+    else if (file_ext && !strncasecmp(file_ext, ".drc", 4))
         is_dirac = 1;
 
     if (!opt->outdir)
         opt->outdir = getcwd(NULL, 0);
 
+    /* The analysis only looks at luma */
+    if (opt->analyze)
+        config->luma_only = 1;
+
     if (is_y4m) {
         open_infile = open_file_y4m;
         read_frame = read_frame_y4m;
@@ -220,38 +524,761 @@ static int parse_options(int argc, char **argv, config_t *config, cli_opt_t *opt
         return -1;
     }
 
+    /* Whole frame unless told otherwise, chroma is subsampled so keep it even */
+    if (config->crop.width == 0 || config->crop.height == 0) {
+        config->crop.x = config->crop.y = 0;
+        config->crop.width = config->width;
+        config->crop.height = config->height;
+    }
+    config->crop.x &= ~1;
+    config->crop.y &= ~1;
+    if (config->crop.x >= config->width || config->crop.y >= config->height) {
+        fprintf(stderr, "ERROR: Crop is outside of the %ux%u frame.\n", config->width, config->height);
+        return -1;
+    }
+    if (config->crop.width > config->width - config->crop.x)
+        config->crop.width = config->width - config->crop.x;
+    if (config->crop.height > config->height - config->crop.y)
+        config->crop.height = config->height - config->crop.y;
+    config->crop.width &= ~1;
+    config->crop.height &= ~1;
+
+    if (opt->incremental && cache_open(opt->outdir, filename, &opt->cache)) {
+        fprintf(stderr, "warning: input is not a regular file, incremental mode disabled\n");
+        opt->cache = NULL;
+    }
+
     return 0;
 }
 
-static int grab_frames(config_t *config, cli_opt_t *opt)
+/* The frame that will be asked for after framenum, -1 if none */
+static int next_frame(config_t *config, int framenum)
 {
-    handle_t hout;
-    picture_t pic;
     int i;
+
+    if (config->frame_cnt == 0)
+        return framenum + 1;
+    for (i = 0; i < config->frame_cnt; i++)
+        if (config->frames[i] > framenum)
+            return config->frames[i];
+    return -1;
+}
+
+/* Read a frame before it is asked for, it is kept until then */
+static picture_t *read_ahead(config_t *config, cli_opt_t *opt, int framenum)
+{
+    picture_t *pic;
+
+    if (opt->ahead_cnt == MAX_LOOKAHEAD
+        || (pic = picture_get(config->csp, config->width, config->height)) == NULL)
+        return NULL;
+    if (read_frame(opt->hin, pic, framenum)) {
+        picture_release(pic);
+        return NULL;
+    }
+
+    opt->ahead[opt->ahead_cnt] = pic;
+    opt->ahead_frame[opt->ahead_cnt++] = framenum;
+    return pic;
+}
+
+static void flush_ahead(cli_opt_t *opt)
+{
+    while (opt->ahead_cnt)
+        picture_release(opt->ahead[--opt->ahead_cnt]);
+}
+
+/* Read a frame, or take it from those read ahead. Frames are asked for in
+ * order, so the ones read ahead of framenum that were skipped are dropped. */
+static int fetch_frame(config_t *config, cli_opt_t *opt, picture_t *pic, int framenum)
+{
+    int i, cnt = 0, found = 0;
+
+    for (i = 0; i < opt->ahead_cnt; i++) {
+        picture_t *ahead = opt->ahead[i];
+
+        if (opt->ahead_frame[i] > framenum) {
+            opt->ahead_frame[cnt] = opt->ahead_frame[i];
+            opt->ahead[cnt++] = ahead;
+            continue;
+        }
+        /* Both come from the same pool, so the contents can be swapped */
+        if (opt->ahead_frame[i] == framenum && !found) {
+            picture_t tmp = *pic;
+            *pic = *ahead;
+            *ahead = tmp;
+            found = 1;
+        }
+        picture_release(ahead);
+    }
+    opt->ahead_cnt = cnt;
+
+    return found ? 0 : read_frame(opt->hin, pic, framenum);
+}
+
+/* Detect on the first frame read, then only read the crop. A black frame,
+ * as in a fade in, tells nothing, so the frames after it are read ahead
+ * until one does. */
+static void resolve_crop(config_t *config, cli_opt_t *opt, picture_t *pic, int framenum)
+{
+    picture_t *probe = pic;
+    int i;
+
+    if (!opt->crop_auto)
+        return;
+
+    while (detect_letterbox(probe, config)) {
+        if ((framenum = next_frame(config, framenum)) < 0
+            || (probe = read_ahead(config, opt, framenum)) == NULL) {
+            fprintf(stderr, "letterbox: no picture in the first frames, not cropping\n");
+            break;
+        }
+    }
+
+    pic->roi = config->crop;
+    for (i = 0; i < opt->ahead_cnt; i++)
+        opt->ahead[i]->roi = config->crop;
+    opt->crop_auto = 0;
+}
+
+/* Read a frame, resolving an automatic crop on the first one */
+static int get_frame(config_t *config, cli_opt_t *opt, picture_t *pic, int framenum)
+{
+    if (fetch_frame(config, opt, pic, framenum)) {
+        fprintf(stderr, "ERROR: could not read frame %d\n", framenum);
+        return -1;
+    }
+
+    resolve_crop(config, opt, pic, framenum);
+
+    return 0;
+}
+
+static int write_output(config_t *config, cli_opt_t *opt, picture_t *pic, char *name, uint64_t key)
+{
+    handle_t hout;
     char tmp[PATH_MAX];
+    output_param_t param;
+    int ret;
+
+    snprintf(tmp, PATH_MAX, "%s/%s", opt->outdir, name);
+    param.zlevel = opt->zlevel;
+    param.quality = opt->quality;
+    param.strategy = OUTPUT_STRATEGY_AUTO;
+    param.filter = OUTPUT_FILTER_AUTO;
+
+    if (opt->output->open_file(tmp, &hout, &param)) {
+        fprintf(stderr, "ERROR: could not open output file '%s'\n", tmp);
+        return -1;
+    }
+    ret = opt->output->write_image(hout, pic, config);
+    ret |= opt->output->close_file(hout);
+    if (ret) {
+        fprintf(stderr, "ERROR: could not write '%s'\n", tmp);
+        unlink(tmp);
+        return -1;
+    }
+
+    if (opt->cache)
+        cache_update(opt->cache, name, key);
+
+    return 0;
+}
+
+/* Renditions are sized from the crop, so this waits for the first frame */
+static int setup_renditions(config_t *config, cli_opt_t *opt)
+{
+    rendition_t *r, *prev = NULL;
+    int i;
+
+    for (i = 0; i < opt->rendition_cnt; i++, prev = r) {
+        r = &opt->renditions[i];
+        r->config = *config;
+
+        /* Never scaled up, these come straight from the decoded frame */
+        if (r->width == 0 || r->width >= config->crop.width)
+            continue;
+
+        r->config.width = r->width;
+        r->config.height = ((uint64_t)r->width * config->crop.height / config->crop.width) & ~1;
+        if (r->config.height < 2)
+            r->config.height = 2;
+        r->config.crop.x = r->config.crop.y = 0;
+        r->config.crop.width = r->config.width;
+        r->config.crop.height = r->config.height;
+
+        r->pic = picture_get(config->csp, r->config.width, r->config.height);
+
+        r->sws = sws_getContext(prev ? prev->config.crop.width : config->crop.width,
+                                prev ? prev->config.crop.height : config->crop.height, csp_pix_fmt(config->csp),
+                                r->config.width, r->config.height, csp_pix_fmt(config->csp),
+                                SWS_AREA | SWS_ACCURATE_RND, NULL, NULL, NULL);
+        if (r->pic == NULL || r->sws == NULL)
+            return -1;
+    }
+
+    /* The renditions are encoded side by side but share the frame's budget,
+     * each tunable one gets the part of it that its pixels are */
+    if (opt->budget_ns) {
+        int64_t pixels = 0;
+        for (i = 0; i < opt->rendition_cnt; i++) {
+            r = &opt->renditions[i];
+            if (r->output->flags & OUTPUT_TUNABLE)
+                pixels += (int64_t)r->config.crop.width * r->config.crop.height;
+        }
+        for (i = 0; i < opt->rendition_cnt; i++) {
+            r = &opt->renditions[i];
+            if ((r->output->flags & OUTPUT_TUNABLE)
+                && budget_new(&r->budget, (double)opt->budget_ns * r->config.crop.width * r->config.crop.height / pixels))
+                return -1;
+        }
+    }
+
+    opt->renditions_ready = 1;
+    return 0;
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void *encode_rendition(void *arg)
+{
+    rendition_t *r = arg;
+    int64_t pixels = (int64_t)r->config.crop.width * r->config.crop.height;
+    int64_t start = 0;
+    struct stat sb;
+    handle_t hout;
+
+    r->ret = -1;
+    if (r->output->flags & OUTPUT_STREAM) {
+        if (r->hout == NULL && r->output->open_file(r->path, &r->hout, &r->param)) {
+            fprintf(stderr, "ERROR: could not open output file '%s'\n", r->path);
+            r->hout = NULL;
+            return NULL;
+        }
+        if ((r->ret = r->output->write_image(r->hout, r->pic, &r->config)))
+            fprintf(stderr, "ERROR: could not write '%s'\n", r->path);
+        return NULL;
+    }
+
+    if (r->budget) {
+        budget_choose(r->budget, &r->param, pixels);
+        start = now_ns();
+    }
+
+    /* It may be hardlinked to other frames' by --dedup, never write through */
+    unlink(r->path);
+
+    if (r->output->open_file(r->path, &hout, &r->param)) {
+        fprintf(stderr, "ERROR: could not open output file '%s'\n", r->path);
+        return NULL;
+    }
+    r->ret = r->output->write_image(hout, r->pic, &r->config);
+    r->ret |= r->output->close_file(hout);
+    if (r->ret) {
+        fprintf(stderr, "ERROR: could not write '%s'\n", r->path);
+        unlink(r->path);
+        return NULL;
+    }
+
+    if (r->budget && stat(r->path, &sb) == 0)
+        budget_update(r->budget, now_ns() - start, sb.st_size, pixels);
+
+    return NULL;
+}
+
+/* Scale down the chain of renditions and encode the stale ones in parallel */
+static int write_renditions(config_t *config, cli_opt_t *opt, picture_t *pic)
+{
+    rendition_t *r, *prev = NULL;
+    uint8_t *src[4];
+    int *src_stride;
+    int i, threads = 0;
+    int64_t start = now_ns();
+
+    if (!opt->renditions_ready && setup_renditions(config, opt)) {
+        fprintf(stderr, "ERROR: could not set up renditions\n");
+        return -1;
+    }
 
-    pic.img.plane[0] = calloc(1, 3 * config->width * config->height / 2);
-    pic.img.plane[1] = pic.img.plane[0] + config->width * config->height;
-    pic.img.plane[2] = pic.img.plane[1] + config->width * config->height / 4;
-    pic.img.plane[3] = NULL;
+    for (i = 0; i < opt->rendition_cnt; i++, prev = r) {
+        r = &opt->renditions[i];
 
-    pic.img.stride[0] = config->width;
-    pic.img.stride[1] = pic.img.stride[2] = config->width / 2;
-    pic.img.stride[3] = 0;
+        if (r->sws == NULL) {
+            r->pic = pic;
+        } else {
+            if (prev && prev->sws) {
+                memcpy(src, prev->pic->img.plane, sizeof(src));
+                src_stride = prev->pic->img.stride;
+            } else {
+                picture_crop(pic, config->csp, &config->crop, src);
+                src_stride = pic->img.stride;
+            }
+            sws_scale(r->sws, src, src_stride, 0, prev && prev->sws ? prev->config.height : config->crop.height,
+                      r->pic->img.plane, r->pic->img.stride);
+            __asm__ volatile ("emms\n\t");
+            r->pic->pts = pic->pts;
+        }
+
+        if (!r->stale)
+            continue;
+
+        /* Encode while the next rendition is being scaled */
+        if (!(r->output->flags & OUTPUT_STREAM))
+            snprintf(r->path, PATH_MAX, "%s/%s", opt->outdir, r->name);
+        if (opt->rendition_cnt > 1 && pthread_create(&r->thread, NULL, encode_rendition, r) == 0)
+            threads |= 1 << i;
+        else
+            encode_rendition(r);
+    }
+
+    for (i = 0; i < opt->rendition_cnt; i++) {
+        r = &opt->renditions[i];
+        if (threads & (1 << i))
+            pthread_join(r->thread, NULL);
+        if (r->stale && r->ret == 0 && opt->cache && !(r->output->flags & OUTPUT_STREAM))
+            cache_update(opt->cache, r->name, r->key);
+    }
+
+    /* What the budget is held to: the whole frame, every rendition */
+    if (opt->budget_ns) {
+        int64_t ns = now_ns() - start;
+        opt->budget_frames++;
+        opt->budget_over += ns > opt->budget_ns;
+        opt->budget_total_ns += ns;
+    }
+
+    return 0;
+}
+
+/* All frames tiled onto one image */
+static int grab_sheet(config_t *config, cli_opt_t *opt, picture_t *pic, char *params, size_t params_size)
+{
+    sheet_t *sheet = NULL;
+    picture_t canvas;
+    config_t canvas_config;
+    char name[NAME_MAX + 1];
+    uint64_t key = 0;
+    int i, ret = 0;
+
+    snprintf(name, sizeof(name), "sheet.%s", opt->output->ext);
+
+    if (opt->cache) {
+        snprintf(params + strlen(params), params_size - strlen(params), " %s sheet %dx%d %08lx", opt->output->name, opt->sheet_columns, opt->tile_width,
+                 crc32(0, (uint8_t *)config->frames, config->frame_cnt * sizeof(*config->frames)));
+        key = cache_key(opt->cache, config->frame_cnt, params);
+        if (cache_lookup(opt->cache, name, key))
+            return 0;
+    }
 
     for (i = 0; i < config->frame_cnt; i++) {
-        read_frame(opt->hin, &pic, config->frames[i]);
+        if (get_frame(config, opt, pic, config->frames[i]))
+            continue;
+
+        if (sheet == NULL && sheet_new(&sheet, config, opt->sheet_columns, opt->tile_width, config->frame_cnt)) {
+            fprintf(stderr, "ERROR: could not create contact sheet\n");
+            return -1;
+        }
 
-        snprintf(tmp, PATH_MAX, "%s/%05d.png", opt->outdir, config->frames[i]);
-        open_outfile(tmp, &hout, opt->zlevel);
-        write_image(hout, &pic, config);
-        close_outfile(hout);
+        sheet_add(sheet, pic, i);
     }
 
+    if (sheet == NULL)
+        return -1;
+
+    canvas_config = *config;
+    sheet_picture(sheet, &canvas, &canvas_config);
+    ret = write_output(&canvas_config, opt, &canvas, name, key);
+
+    sheet_free(sheet);
+
+    return ret;
+}
+
+static void rendition_name(rendition_t *r, int framenum, char *name)
+{
+    if (r->width)
+        snprintf(name, NAME_MAX + 1, "%05d_%dw.%s", framenum, r->width, r->output->ext);
+    else
+        snprintf(name, NAME_MAX + 1, "%05d.%s", framenum, r->output->ext);
+}
+
+/* Give dst the contents of src: a hardlink, else a reflink, else a copy */
+static int reuse_output(const char *src, const char *dst)
+{
+    char buf[65536];
+    ssize_t n = 0;
+    int in, out;
+
+    unlink(dst);
+    if (link(src, dst) == 0)
+        return 0;
+
+    if ((in = open(src, O_RDONLY)) < 0)
+        return -1;
+    if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        close(in);
+        return -1;
+    }
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0)
+        goto done;
+#endif
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+        if (write(out, buf, n) != n) {
+            n = -1;
+            break;
+        }
+#ifdef FICLONE
+done:
+#endif
+    close(in);
+    if (close(out) || n < 0) {
+        unlink(dst);
+        return -1;
+    }
+    return 0;
+}
+
+static int find_seen(config_t *config, cli_opt_t *opt, picture_t *pic, uint64_t hash)
+{
+    int i;
+    for (i = 0; i < opt->seen_cnt && i < MAX_SEEN; i++)
+        if (opt->seen[i].hash == hash && picture_equal(pic, config->csp, &config->crop, opt->seen[i].pic))
+            return opt->seen[i].framenum;
+    return -1;
+}
+
+static void add_seen(config_t *config, cli_opt_t *opt, picture_t *pic, uint64_t hash, int framenum)
+{
+    seen_frame_t *seen = &opt->seen[opt->seen_cnt % MAX_SEEN];
+    picture_t *copy;
+
+    if ((copy = picture_copy(pic, config->csp, &config->crop)) == NULL)
+        return;
+    picture_release(seen->pic);
+    seen->hash = hash;
+    seen->framenum = framenum;
+    seen->pic = copy;
+    opt->seen_cnt++;
+}
+
+/* Point the stale images of framenum at those of an identical frame. The
+ * streams still need the pixels, the number of those left is returned. */
+static int reuse_renditions(cli_opt_t *opt, int framenum, int src_frame)
+{
+    char name[NAME_MAX + 1], src[PATH_MAX], dst[PATH_MAX];
+    int i, stale = 0;
+
+    for (i = 0; i < opt->rendition_cnt; i++) {
+        rendition_t *r = &opt->renditions[i];
+        if (!r->stale)
+            continue;
+        if (r->output->flags & OUTPUT_STREAM) {
+            stale++;
+            continue;
+        }
+
+        rendition_name(r, src_frame, name);
+        snprintf(src, PATH_MAX, "%s/%s", opt->outdir, name);
+        snprintf(dst, PATH_MAX, "%s/%s", opt->outdir, r->name);
+        if (reuse_output(src, dst)) {
+            stale++;
+            continue;
+        }
+
+        r->stale = 0;
+        if (opt->cache)
+            cache_update(opt->cache, r->name, r->key);
+    }
+
+    return stale;
+}
+
+/* Whether every image of the frame just written is on disk */
+static int images_written(cli_opt_t *opt)
+{
+    int i;
+    for (i = 0; i < opt->rendition_cnt; i++) {
+        rendition_t *r = &opt->renditions[i];
+        if (!(r->output->flags & OUTPUT_STREAM) && r->stale && r->ret)
+            return 0;
+    }
+    return 1;
+}
+
+/* Every output can be copied straight from the input, so no pixels need
+ * to be read at all */
+static int raw_only(config_t *config, cli_opt_t *opt)
+{
+    int i;
+
+    if (!config->frame_refs || opt->crop_auto || opt->sheet_columns
+        || config->crop.width != config->width || config->crop.height != config->height)
+        return 0;
+
+    for (i = 0; i < opt->rendition_cnt; i++) {
+        rendition_t *r = &opt->renditions[i];
+        if (!(r->output->flags & OUTPUT_RAW) || (r->width && r->width < config->crop.width))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int grab_frames(config_t *config, cli_opt_t *opt)
+{
+    picture_t *pic;
+    rendition_t *r;
+    int i, j, stale, dup;
+    uint64_t hash = 0;
+    char params[128];
+
+    if ((pic = picture_get(config->csp, config->width, config->height)) == NULL) {
+        fprintf(stderr, "ERROR: could not allocate picture\n");
+        return -1;
+    }
+
+    /* The cache keys need the crop before anything else is read */
+    if (opt->crop_auto && opt->cache) {
+        picture_t *first = read_ahead(config, opt, config->frames[0]);
+        if (first) {
+            resolve_crop(config, opt, first, config->frames[0]);
+        } else {
+            fprintf(stderr, "warning: could not detect the crop up front, incremental mode disabled\n");
+            cache_close(opt->cache);
+            opt->cache = NULL;
+        }
+    }
+
+    /* Letterbox detection needs to see the whole frame */
+    if (!opt->crop_auto)
+        pic->roi = config->crop;
+    /* Nothing to hash then, and only streams, which are never linked */
+    if (raw_only(config, opt)) {
+        memset(&pic->roi, 0, sizeof(pic->roi));
+        opt->dedup = 0;
+    }
+
+    /* Everything that changes the bytes of an output goes into its cache key */
+    snprintf(params, sizeof(params), "z%d q%d %ux%u+%u+%u", opt->zlevel, opt->quality,
+             config->crop.width, config->crop.height, config->crop.x, config->crop.y);
+    if (config->luma_only)
+        snprintf(params + strlen(params), sizeof(params) - strlen(params), " gray");
+    if (opt->budget_ns && !opt->sheet_columns)
+        snprintf(params + strlen(params), sizeof(params) - strlen(params), " b%"PRId64, opt->budget_ns);
+
+    if (opt->sheet_columns) {
+        grab_sheet(config, opt, pic, params, sizeof(params));
+    } else {
+        for (j = 0; j < opt->rendition_cnt; j++) {
+            r = &opt->renditions[j];
+            snprintf(r->params, sizeof(r->params), "%s %s w%d z%d q%d", params, r->output->name,
+                     r->width, r->param.zlevel, r->param.quality);
+
+            /* One file for the run, always rewritten */
+            if (r->output->flags & OUTPUT_STREAM) {
+                if (r->width)
+                    snprintf(r->name, sizeof(r->name), "frames_%dw.%s", r->width, r->output->ext);
+                else
+                    snprintf(r->name, sizeof(r->name), "frames.%s", r->output->ext);
+                snprintf(r->path, PATH_MAX, "%s/%s", opt->outdir, r->name);
+            }
+        }
+
+        for (i = 0; i < config->frame_cnt; i++) {
+            for (j = stale = 0; j < opt->rendition_cnt; j++) {
+                r = &opt->renditions[j];
+                if (r->output->flags & OUTPUT_STREAM) {
+                    stale += r->stale = 1;
+                    continue;
+                }
+                rendition_name(r, config->frames[i], r->name);
+
+                r->stale = 1;
+                if (opt->cache) {
+                    r->key = cache_key(opt->cache, config->frames[i], r->params);
+                    r->stale = !cache_lookup(opt->cache, r->name, r->key);
+                }
+                stale += r->stale;
+            }
+
+            if (!stale)
+                continue;
+
+            if (get_frame(config, opt, pic, config->frames[i]))
+                continue;
+
+            dup = -1;
+            if (opt->dedup) {
+                hash = hash_picture(pic, config->csp, &config->crop);
+                if ((dup = find_seen(config, opt, pic, hash)) >= 0) {
+                    opt->reused_cnt++;
+                    if (!reuse_renditions(opt, config->frames[i], dup))
+                        continue;
+                }
+            }
+
+            write_renditions(config, opt, pic);
+
+            if (opt->dedup && dup < 0 && images_written(opt))
+                add_seen(config, opt, pic, hash, config->frames[i]);
+        }
+
+        if (opt->reused_cnt)
+            fprintf(stderr, "dedup: %d of %d frames reused the images of an identical one\n",
+                    opt->reused_cnt, config->frame_cnt);
+    }
+
+    if (opt->budget_frames)
+        fprintf(stderr, "budget: %"PRId64" frames, %.2f ms average against %.2f ms, %"PRId64" over\n",
+                opt->budget_frames, opt->budget_total_ns / 1e6 / opt->budget_frames,
+                opt->budget_ns / 1e6, opt->budget_over);
+    for (j = 0; j < opt->rendition_cnt; j++) {
+        r = &opt->renditions[j];
+        if (r->hout && r->output->close_file(r->hout))
+            fprintf(stderr, "ERROR: could not write '%s'\n", r->path);
+        if (r->sws) {
+            sws_freeContext(r->sws);
+            picture_release(r->pic);
+        }
+        if (r->budget) {
+            char name[32];
+            if (r->width)
+                snprintf(name, sizeof(name), "%s %dw", r->output->name, r->width);
+            else
+                snprintf(name, sizeof(name), "%s", r->output->name);
+            budget_report(r->budget, name, stderr);
+            budget_free(r->budget);
+        }
+    }
+    picture_release(pic);
+    flush_ahead(opt);
+    for (i = 0; i < opt->seen_cnt && i < MAX_SEEN; i++)
+        picture_release(opt->seen[i].pic);
+
     close_infile(opt->hin);
+    cache_close(opt->cache);
 
     if (opt->outdir)
         free(opt->outdir);
 
     return 0;
 }
+
+/* Metrics of the requested frames, or of every frame until the input ends */
+static int grab_analysis(config_t *config, cli_opt_t *opt)
+{
+    picture_t *pic[2];
+    analyze_t *a = NULL;
+    int all = config->frame_cnt == 0;
+    int i, framenum, cur = 0, have_prev = 0, ret = 0;
+
+    pic[0] = picture_get(config->csp, config->width, config->height);
+    pic[1] = picture_get(config->csp, config->width, config->height);
+    if (pic[0] == NULL || pic[1] == NULL) {
+        fprintf(stderr, "ERROR: could not allocate picture\n");
+        ret = -1;
+        goto done;
+    }
+    if (!opt->crop_auto)
+        pic[0]->roi = pic[1]->roi = config->crop;
+
+    for (i = 0; all || i < config->frame_cnt; i++) {
+        framenum = all ? i : config->frames[i];
+
+        /* Running off the end is how a full pass finishes */
+        if (all ? fetch_frame(config, opt, pic[cur], framenum) : get_frame(config, opt, pic[cur], framenum)) {
+            if (all)
+                break;
+            continue;
+        }
+        resolve_crop(config, opt, pic[cur], framenum);
+        pic[!cur]->roi = config->crop;
+
+        if (a == NULL && analyze_new(&a, config, opt->analyze, stdout)) {
+            ret = -1;
+            break;
+        }
+        if (analyze_frame(a, pic[cur], have_prev ? pic[!cur] : NULL, framenum)) {
+            ret = -1;
+            break;
+        }
+
+        have_prev = 1;
+        cur = !cur;
+    }
+
+done:
+    analyze_free(a);
+    picture_release(pic[0]);
+    picture_release(pic[1]);
+    flush_ahead(opt);
+
+    close_infile(opt->hin);
+    cache_close(opt->cache);
+    free(opt->outdir);
+
+    return ret;
+}
+
+/* Rows and columns are letterboxing when no luma sample rises above this */
+#define LETTERBOX_THRESHOLD 40
+
+static int row_is_black(uint8_t *p, int len, int step)
+{
+    int i;
+    for (i = 0; i < len; i++, p += step)
+        if (*p > LETTERBOX_THRESHOLD)
+            return 0;
+    return 1;
+}
+
+/* Sets the crop to the picture inside the letterbox, -1 if there is none */
+static int detect_letterbox(picture_t *pic, config_t *config)
+{
+    int stride = pic->img.stride[0];
+    uint8_t *luma = pic->img.plane[0];
+    int top = 0, bottom = config->height, left = 0, right = config->width;
+    int bytes = 1;
+
+    /* Only the high byte of MSB aligned 16-bit samples is looked at */
+    if (config->csp & COLORSPACE_HIGH_DEPTH) {
+        luma++;
+        bytes = 2;
+    }
+
+    while (top < bottom && row_is_black(luma + top * stride, config->width, bytes))
+        top++;
+    while (bottom > top && row_is_black(luma + (bottom - 1) * stride, config->width, bytes))
+        bottom--;
+    while (left < right && row_is_black(luma + top * stride + left * bytes, bottom - top, stride))
+        left++;
+    while (right > left && row_is_black(luma + top * stride + (right - 1) * bytes, bottom - top, stride))
+        right--;
+
+    /* Round inwards to even so chroma stays aligned */
+    top = (top + 1) & ~1;
+    left = (left + 1) & ~1;
+    bottom &= ~1;
+    right &= ~1;
+
+    /* An entirely black frame tells us nothing */
+    if (bottom - top < 2 || right - left < 2)
+        return -1;
+
+    config->crop.x = left;
+    config->crop.y = top;
+    config->crop.width = right - left;
+    config->crop.height = bottom - top;
+
+    fprintf(stderr, "letterbox: cropping to %ux%u+%u+%u\n", config->crop.width,
+            config->crop.height, config->crop.x, config->crop.y);
+
+    return 0;
+}
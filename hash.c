@@ -0,0 +1,181 @@
+/*****************************************************************************
+* hash.c: picture content hashing.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#include "common.h"
+#include "hash.h"
+#include "picture.h"
+
+/* A multiply-accumulate hash over eight 64-bit lanes: each stripe of 64
+ * bytes adds the product of the halves of data ^ key to its own lane and the
+ * data to its neighbour, with a scramble every block, finished with a 64-bit
+ * avalanche. It is fed row by row over the cropped planes. The value is
+ * only ever compared within one run, and only picks the candidates the
+ * samples are compared with. */
+
+#define STRIPE 64
+#define BLOCK_STRIPES 16
+
+#define PRIME32_1 0x9e3779b1U
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+#define PRIME64_4 0x85ebca77c2b2ae63ULL
+
+/* The key, 64 bytes of high entropy */
+static const uint64_t key[8] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+typedef struct {
+    uint64_t acc[8];
+    int stripes;
+    uint64_t len;
+} hash_state_t;
+
+#ifdef HAVE_SSE2
+static void accumulate(uint64_t *acc, const uint8_t *p)
+{
+    int i;
+    for (i = 0; i < 4; i++) {
+        __m128i a = _mm_loadu_si128((__m128i *)acc + i);
+        __m128i d = _mm_loadu_si128((const __m128i *)p + i);
+        __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)key + i));
+        __m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+        a = _mm_add_epi64(a, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+        _mm_storeu_si128((__m128i *)acc + i, _mm_add_epi64(a, prod));
+    }
+}
+
+static void scramble(uint64_t *acc)
+{
+    const __m128i prime = _mm_set1_epi32(PRIME32_1);
+    int i;
+    for (i = 0; i < 4; i++) {
+        __m128i a = _mm_loadu_si128((__m128i *)acc + i);
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)key + i));
+        a = _mm_add_epi64(_mm_mul_epu32(a, prime),
+                          _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), prime), 32));
+        _mm_storeu_si128((__m128i *)acc + i, a);
+    }
+}
+#else
+static uint64_t read64(const uint8_t *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+           | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static void accumulate(uint64_t *acc, const uint8_t *p)
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+        uint64_t d = read64(p + 8 * i);
+        uint64_t dk = d ^ key[i];
+        acc[i ^ 1] += d;
+        acc[i] += (dk & 0xffffffff) * (dk >> 32);
+    }
+}
+
+static void scramble(uint64_t *acc)
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= key[i];
+        acc[i] = a * PRIME32_1;
+    }
+}
+#endif
+
+static void hash_update(hash_state_t *s, const uint8_t *p, int len)
+{
+    uint8_t tail[STRIPE];
+
+    s->len += len;
+    for (; len > 0; len -= STRIPE, p += STRIPE) {
+        /* Rows are rarely a multiple of the stripe, zero pad the rest */
+        if (len < STRIPE) {
+            memcpy(tail, p, len);
+            memset(tail + len, 0, STRIPE - len);
+            p = tail;
+        }
+        accumulate(s->acc, p);
+        if (++s->stripes == BLOCK_STRIPES) {
+            scramble(s->acc);
+            s->stripes = 0;
+        }
+    }
+}
+
+static uint64_t hash_final(hash_state_t *s)
+{
+    uint64_t h = s->len * PRIME64_1;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        uint64_t v = s->acc[i] * PRIME64_2;
+        v = (v << 31 | v >> 33) * PRIME64_1;
+        h ^= v;
+        h = (h << 27 | h >> 37) * PRIME64_1 + PRIME64_4;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/* The samples inside crop, the stride padding is not looked at */
+uint64_t hash_picture(picture_t *pic, int csp, rect_t *crop)
+{
+    hash_state_t s;
+    uint8_t *src[4];
+    int i, y;
+
+    memset(&s, 0, sizeof(s));
+    memcpy(s.acc, key, sizeof(s.acc));
+
+    picture_crop(pic, csp, crop, src);
+    for (i = 0; i < csp_plane_cnt(csp); i++) {
+        int row_size, rows;
+        csp_plane_size(csp, i, crop->width, crop->height, &row_size, &rows);
+        for (y = 0; y < rows; y++)
+            hash_update(&s, src[i] + y * pic->img.stride[i], row_size);
+    }
+
+    return hash_final(&s);
+}
@@ -21,22 +21,157 @@
 * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
 *****************************************************************************/
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <schroedinger/schro.h>
 #include "common.h"
+#include "utils.h"
 #include "dirac.h"
+#include "picture.h"
+
+/* A run of parse units starting at a sequence header, which a fresh
+ * decoder can start from */
+typedef struct {
+    int64_t offset, end;
+    int64_t first_pic, last_pic;
+    /* Requested frames inside it, as indexes into frames */
+    int first, last;
+} dirac_segment_t;
+
+enum {
+    RESULT_PENDING,
+    RESULT_READY,
+    RESULT_FAILED,
+    RESULT_SKIPPED
+};
+
+typedef struct {
+    int state;
+    int segment;
+    SchroFrame *frame;
+} dirac_result_t;
+
+/* Output frames that were pulled but not wanted, for the decoder to
+ * write the next pictures into */
+#define DIRAC_SPARE_FRAMES 4
+
+typedef struct {
+    SchroFrame *frame[DIRAC_SPARE_FRAMES];
+    int cnt;
+} frame_list_t;
 
 typedef struct {
     FILE *fp;
     SchroDecoder *schro;
     SchroVideoFormat *format;
+    frame_list_t spare;
+
+    /* Requested frames, sorted */
+    uint32_t *frames;
+    int frame_cnt;
+
+    /* Segment parallel decoding, only used with a seekable file */
+    char *filename;
+    int thread_cnt;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t ready_cond;
+    int quit;
+    dirac_result_t *results;
+    int cursor;             /* next result read_frame looks at */
+    dirac_segment_t *segments;
+    int segment_cnt;
+    int next_segment;       /* next one a worker takes */
+    int head;               /* segment the reader is waiting on */
+    int window;             /* segments decoded ahead of the reader */
 } dirac_input_t;
 
 #define DIRAC_PARSE_MAGIC "BBCD"
+#define DIRAC_PARSE_HEADER 13
 
-int parse_packet(dirac_input_t *h, uint8_t **data, int *pkt_size);
+/* Parse codes */
+#define DIRAC_SEQUENCE_HEADER 0x00
+#define DIRAC_END_OF_SEQUENCE 0x10
+#define DIRAC_IS_PICTURE(code) ((code) & 0x08)
+#define DIRAC_IS_REFERENCE(code) ((code) & 0x04)
+
+static int parse_packet(FILE *fp, uint8_t **data, int *pkt_size);
 static void buffer_free(SchroBuffer *buf, void *priv);
+static int open_parallel(dirac_input_t *h, char *filename, config_t *config);
+
+/* Strides of the decoded frame and the picture differ */
+static void copy_frame(picture_t *pic, SchroFrame *frame)
+{
+    int i, y;
+
+    for (i = 0; i < pic->img.plane_cnt; i++) {
+        SchroFrameData *comp = &frame->components[i];
+        uint8_t *src = comp->data;
+        uint8_t *dst = pic->img.plane[i];
+
+        for (y = 0; y < comp->height; y++, src += comp->stride, dst += pic->img.stride[i])
+            memcpy(dst, src, comp->width);
+    }
+}
+
+static SchroFrame *new_frame(SchroVideoFormat *format)
+{
+    switch (format->chroma_format) {
+        case SCHRO_CHROMA_444:
+            return schro_frame_new_and_alloc(NULL, SCHRO_FRAME_FORMAT_U8_444, format->width, format->height);
+        case SCHRO_CHROMA_422:
+            return schro_frame_new_and_alloc(NULL, SCHRO_FRAME_FORMAT_U8_422, format->width, format->height);
+        case SCHRO_CHROMA_420:
+            return schro_frame_new_and_alloc(NULL, SCHRO_FRAME_FORMAT_U8_420, format->width, format->height);
+    }
+    return NULL;
+}
+
+static SchroFrame *get_frame(frame_list_t *l, SchroVideoFormat *format)
+{
+    if (l->cnt)
+        return l->frame[--l->cnt];
+    return new_frame(format);
+}
+
+static void put_frame(frame_list_t *l, SchroFrame *frame)
+{
+    if (l->cnt < DIRAC_SPARE_FRAMES)
+        l->frame[l->cnt++] = frame;
+    else
+        schro_frame_unref(frame);
+}
+
+static void flush_frames(frame_list_t *l)
+{
+    while (l->cnt)
+        schro_frame_unref(l->frame[--l->cnt]);
+}
+
+static uint32_t read_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Nothing is predicted from a non-reference picture, so one that wasn't
+ * asked for can be dropped before it reaches the decoder */
+static int drop_picture(dirac_input_t *h, const uint8_t *packet, int size)
+{
+    uint32_t picnum;
+
+    if (h->frame_cnt == 0 || size < DIRAC_PARSE_HEADER + 4
+        || !DIRAC_IS_PICTURE(packet[4]) || DIRAC_IS_REFERENCE(packet[4]))
+        return 0;
+
+    picnum = read_be32(packet + DIRAC_PARSE_HEADER);
+    return bsearch(&picnum, h->frames, h->frame_cnt, sizeof(*h->frames), intcmp) == NULL;
+}
 
 int open_file_dirac(char *filename, handle_t *handle, config_t *config)
 {
@@ -53,7 +188,7 @@ int open_file_dirac(char *filename, handle_t *handle, config_t *config)
     if (h->fp == NULL)
         return -1;
 
-    if (parse_packet(h, &packet, &size))
+    if (parse_packet(h->fp, &packet, &size))
         return -1;
 
     if (size == 0)
@@ -77,20 +212,399 @@ int open_file_dirac(char *filename, handle_t *handle, config_t *config)
 
     config->width = h->format->width;
     config->height = h->format->height;
+    config->fps_num = h->format->frame_rate_numerator;
+    config->fps_den = h->format->frame_rate_denominator;
+    config->sar_width = h->format->aspect_ratio_numerator;
+    config->sar_height = h->format->aspect_ratio_denominator;
+    config->bit_depth = 8;
     switch (h->format->chroma_format) {
         case SCHRO_CHROMA_420:
             config->csp = COLORSPACE_420;
             break;
-        case SCHRO_CHROMA_444:
         case SCHRO_CHROMA_422:
+            config->csp = COLORSPACE_422;
+            break;
+        case SCHRO_CHROMA_444:
+            config->csp = COLORSPACE_444;
+            break;
+        default:
             fprintf(stderr, "ERROR: Unsupported chroma format.\n");
             return -1;
     }
+    /* Chroma is still decoded, but not copied out */
+    if (config->luma_only)
+        config->csp = COLORSPACE_400;
+
+    if (config->frame_cnt) {
+        h->frame_cnt = config->frame_cnt;
+        if ((h->frames = malloc(h->frame_cnt * sizeof(*h->frames))) == NULL)
+            return -1;
+        memcpy(h->frames, config->frames, h->frame_cnt * sizeof(*h->frames));
+    }
+
+    if (h->fp != stdin && open_parallel(h, filename, config))
+        fprintf(stderr, "warning: could not index '%s', decoding serially\n", filename);
 
     *handle = (handle_t)h;
     return 0;
 }
 
+/* Walk the parse unit headers, splitting the file at every sequence header.
+ * Only the headers and picture numbers are read. */
+static int build_index(dirac_input_t *h, FILE *fp, int64_t file_size)
+{
+    uint8_t header[DIRAC_PARSE_HEADER + 4];
+    int64_t offset = 0;
+    dirac_segment_t *seg = NULL;
+    int max = 0;
+
+    while (offset + DIRAC_PARSE_HEADER <= file_size) {
+        uint32_t next;
+        int code;
+
+        if (fseeko(fp, offset, SEEK_SET) || fread(header, 1, DIRAC_PARSE_HEADER, fp) != DIRAC_PARSE_HEADER
+            || strncmp((char *)header, DIRAC_PARSE_MAGIC, strlen(DIRAC_PARSE_MAGIC)))
+            return -1;
+        code = header[4];
+        next = read_be32(header + 5);
+
+        if (code == DIRAC_SEQUENCE_HEADER) {
+            if (h->segment_cnt == max) {
+                max = max ? 2 * max : 64;
+                if ((seg = realloc(h->segments, max * sizeof(*seg))) == NULL)
+                    return -1;
+                h->segments = seg;
+            }
+            if (h->segment_cnt)
+                h->segments[h->segment_cnt - 1].end = offset;
+            seg = &h->segments[h->segment_cnt++];
+            memset(seg, 0, sizeof(*seg));
+            seg->offset = offset;
+            seg->first_pic = INT64_MAX;
+            seg->last_pic = -1;
+        } else if (DIRAC_IS_PICTURE(code) && seg) {
+            int64_t pic;
+            if (fread(header + DIRAC_PARSE_HEADER, 1, 4, fp) != 4)
+                return -1;
+            pic = read_be32(header + DIRAC_PARSE_HEADER);
+            if (pic < seg->first_pic)
+                seg->first_pic = pic;
+            if (pic > seg->last_pic)
+                seg->last_pic = pic;
+        }
+
+        if (code == DIRAC_END_OF_SEQUENCE)
+            break;
+        /* Without the offset to the next unit there's nothing to walk */
+        if (next == 0)
+            return -1;
+        offset += next;
+    }
+
+    if (h->segment_cnt == 0)
+        return -1;
+    h->segments[h->segment_cnt - 1].end = file_size;
+
+    return 0;
+}
+
+/* Hand the requested frames out to the segments holding them, and drop the
+ * segments that end up with none */
+static void assign_frames(dirac_input_t *h)
+{
+    int i, s = 0, used = 0;
+
+    for (i = 0; i < h->frame_cnt; i++) {
+        while (s < h->segment_cnt && h->segments[s].last_pic < (int64_t)h->frames[i])
+            s++;
+        if (s == h->segment_cnt || h->segments[s].first_pic > (int64_t)h->frames[i]) {
+            h->results[i].state = RESULT_FAILED;
+            continue;
+        }
+        if (used == 0 || h->segments[used - 1].offset != h->segments[s].offset) {
+            h->segments[used] = h->segments[s];
+            h->segments[used].first = i;
+            used++;
+        }
+        h->segments[used - 1].last = i + 1;
+        h->results[i].segment = used - 1;
+    }
+
+    h->segment_cnt = used;
+}
+
+/* Hand a decoded picture to every result waiting for it, returns how many
+ * of the segment's frames are still pending */
+static int deliver(dirac_input_t *h, dirac_segment_t *seg, int64_t picnum, SchroFrame *frame, int *used)
+{
+    int i, pending = 0;
+
+    *used = 0;
+
+    pthread_mutex_lock(&h->mutex);
+    for (i = seg->first; i < seg->last; i++) {
+        dirac_result_t *r = &h->results[i];
+        if (r->state == RESULT_PENDING && frame && h->frames[i] == picnum) {
+            r->frame = schro_frame_ref(frame);
+            r->state = RESULT_READY;
+            *used = 1;
+        } else if (r->state == RESULT_PENDING && frame == NULL) {
+            r->state = RESULT_FAILED;
+        }
+        pending += r->state == RESULT_PENDING;
+    }
+    pthread_cond_broadcast(&h->ready_cond);
+    pthread_mutex_unlock(&h->mutex);
+
+    return pending;
+}
+
+static void decode_segment(dirac_input_t *h, FILE *fp, dirac_segment_t *seg)
+{
+    SchroDecoder *schro = schro_decoder_new();
+    SchroBuffer *buffer;
+    SchroFrame *frame;
+    frame_list_t spare = { { NULL }, 0 };
+    uint8_t *packet;
+    int size, used, eos = 0, pending = 1;
+
+    if (fseeko(fp, seg->offset, SEEK_SET))
+        goto done;
+    schro_decoder_set_earliest_frame(schro, h->frames[seg->first]);
+
+    while (pending) {
+        switch (schro_decoder_wait(schro)) {
+            case SCHRO_DECODER_NEED_BITS:
+                if (eos)
+                    goto done;
+                if (ftello(fp) >= seg->end || parse_packet(fp, &packet, &size) || size == 0) {
+                    schro_decoder_push_end_of_stream(schro);
+                    eos = 1;
+                    break;
+                }
+                if (drop_picture(h, packet, size)) {
+                    free(packet);
+                    break;
+                }
+                buffer = schro_buffer_new_with_data(packet, size);
+                buffer->free = buffer_free;
+                buffer->priv = packet;
+                schro_decoder_push(schro, buffer);
+                break;
+            case SCHRO_DECODER_NEED_FRAME:
+                if ((frame = get_frame(&spare, h->format)) == NULL)
+                    goto done;
+                schro_decoder_add_output_picture(schro, frame);
+                break;
+            case SCHRO_DECODER_OK:
+                {
+                    int64_t picnum = schro_decoder_get_picture_number(schro);
+                    frame = schro_decoder_pull(schro);
+                    if (frame) {
+                        pending = deliver(h, seg, picnum, frame, &used);
+                        if (used)
+                            schro_frame_unref(frame);
+                        else
+                            put_frame(&spare, frame);
+                    }
+                }
+                break;
+            case SCHRO_DECODER_EOS:
+            case SCHRO_DECODER_ERROR:
+                goto done;
+        }
+    }
+
+done:
+    /* Whatever wasn't found isn't there */
+    deliver(h, seg, -1, NULL, &used);
+    schro_decoder_free(schro);
+    flush_frames(&spare);
+}
+
+static void *dirac_worker(void *arg)
+{
+    dirac_input_t *h = arg;
+    FILE *fp = fopen(h->filename, "rb");
+    dirac_segment_t *seg;
+    int used;
+
+    pthread_mutex_lock(&h->mutex);
+    for (;;) {
+        while (!h->quit && h->next_segment < h->segment_cnt && h->next_segment >= h->head + h->window)
+            pthread_cond_wait(&h->work_cond, &h->mutex);
+        if (h->quit || h->next_segment >= h->segment_cnt)
+            break;
+        seg = &h->segments[h->next_segment++];
+
+        pthread_mutex_unlock(&h->mutex);
+        if (fp)
+            decode_segment(h, fp, seg);
+        else
+            deliver(h, seg, -1, NULL, &used);
+        pthread_mutex_lock(&h->mutex);
+    }
+    pthread_mutex_unlock(&h->mutex);
+
+    if (fp)
+        fclose(fp);
+
+    return NULL;
+}
+
+static void free_parallel(dirac_input_t *h)
+{
+    int i;
+
+    if (h->results)
+        for (i = 0; i < h->frame_cnt; i++)
+            if (h->results[i].frame)
+                schro_frame_unref(h->results[i].frame);
+    free(h->threads);
+    free(h->filename);
+    free(h->results);
+    free(h->segments);
+    h->threads = NULL;
+    h->filename = NULL;
+    h->results = NULL;
+    h->segments = NULL;
+    h->segment_cnt = 0;
+}
+
+/* Tell the workers to stop and wait for them */
+static void stop_workers(dirac_input_t *h, int cnt)
+{
+    int i;
+
+    pthread_mutex_lock(&h->mutex);
+    h->quit = 1;
+    pthread_cond_broadcast(&h->work_cond);
+    pthread_mutex_unlock(&h->mutex);
+    for (i = 0; i < cnt; i++)
+        pthread_join(h->threads[i], NULL);
+    pthread_mutex_destroy(&h->mutex);
+    pthread_cond_destroy(&h->work_cond);
+    pthread_cond_destroy(&h->ready_cond);
+}
+
+/* Workers are only started by the first read_frame, so a run that finds
+ * every output up to date decodes nothing. If not all of them can be
+ * started the serial decoder takes over, h->fp has not been read from. */
+static int start_workers(dirac_input_t *h)
+{
+    int i;
+
+    if ((h->threads = calloc(h->thread_cnt, sizeof(*h->threads))) == NULL) {
+        free_parallel(h);
+        return -1;
+    }
+
+    pthread_mutex_init(&h->mutex, NULL);
+    pthread_cond_init(&h->work_cond, NULL);
+    pthread_cond_init(&h->ready_cond, NULL);
+
+    for (i = 0; i < h->thread_cnt; i++) {
+        if (pthread_create(&h->threads[i], NULL, dirac_worker, h)) {
+            stop_workers(h, i);
+            free_parallel(h);
+            fprintf(stderr, "warning: could not start decoder threads, decoding serially\n");
+            return -1;
+        }
+    }
+
+    fprintf(stderr, "dirac: %d frames from %d segments on %d threads\n",
+            h->frame_cnt, h->segment_cnt, h->thread_cnt);
+
+    return 0;
+}
+
+/* With a seekable file and more than one thread, the requested frames are
+ * decoded segment by segment by a pool of decoders, at most window
+ * segments ahead of the one read_frame is waiting on. */
+static int open_parallel(dirac_input_t *h, char *filename, config_t *config)
+{
+    struct stat sb;
+    FILE *fp;
+    int ret;
+
+    h->thread_cnt = config->threads ? config->threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (h->thread_cnt <= 1 || config->frame_cnt == 0)
+        return 0;
+
+    if (fstat(fileno(h->fp), &sb) < 0 || !S_ISREG(sb.st_mode))
+        return 0;
+
+    if ((h->results = calloc(h->frame_cnt, sizeof(*h->results))) == NULL)
+        goto error;
+
+    /* Indexed through a handle of its own, so the serial decoder still
+     * starts where the sequence header left h->fp if this falls back */
+    if ((fp = fopen(filename, "rb")) == NULL)
+        goto error;
+    ret = build_index(h, fp, sb.st_size);
+    fclose(fp);
+    if (ret)
+        goto error;
+    assign_frames(h);
+
+    if (h->thread_cnt > h->segment_cnt)
+        h->thread_cnt = h->segment_cnt;
+    if (h->thread_cnt <= 1)
+        goto error;
+    h->window = 2 * h->thread_cnt;
+
+    if ((h->filename = strdup(filename)) == NULL)
+        goto error;
+
+    return 0;
+
+error:
+    free_parallel(h);
+    return h->thread_cnt <= 1 ? 0 : -1;
+}
+
+/* Frames come back in the order they are asked for, requested frames that
+ * are passed over are dropped */
+static int read_frame_parallel(dirac_input_t *h, picture_t *pic, int framenum)
+{
+    SchroFrame *frame = NULL;
+    int i;
+
+    pthread_mutex_lock(&h->mutex);
+
+    for (i = h->cursor; i < h->frame_cnt && h->frames[i] != framenum; i++) {
+        if (h->results[i].frame)
+            schro_frame_unref(h->results[i].frame);
+        h->results[i].frame = NULL;
+        h->results[i].state = RESULT_SKIPPED;
+    }
+    if (i == h->frame_cnt) {
+        pthread_mutex_unlock(&h->mutex);
+        return -1;
+    }
+    h->cursor = i + 1;
+
+    h->head = h->results[i].segment;
+    pthread_cond_broadcast(&h->work_cond);
+
+    while (h->results[i].state == RESULT_PENDING)
+        pthread_cond_wait(&h->ready_cond, &h->mutex);
+
+    frame = h->results[i].frame;
+    h->results[i].frame = NULL;
+    h->results[i].state = RESULT_SKIPPED;
+
+    pthread_mutex_unlock(&h->mutex);
+
+    if (frame == NULL)
+        return -1;
+
+    copy_frame(pic, frame);
+    schro_frame_unref(frame);
+
+    return 0;
+}
+
 /* Lots of this is from schroedinger-tools */
 int read_frame_dirac(handle_t handle, picture_t *pic, int framenum)
 {
@@ -101,6 +615,11 @@ int read_frame_dirac(handle_t handle, picture_t *pic, int framenum)
     SchroFrame *frame;
     int go = 1;
 
+    if (h->segments && !h->threads)
+        start_workers(h);
+    if (h->threads)
+        return read_frame_parallel(h, pic, framenum);
+
     /* This function assumes that it will be called with framenum increasing. */
     schro_decoder_set_earliest_frame(h->schro, framenum);
 
@@ -116,22 +635,9 @@ int read_frame_dirac(handle_t handle, picture_t *pic, int framenum)
                     go = 0;
                     break;
                 case SCHRO_DECODER_NEED_FRAME:
-                    switch (h->format->chroma_format) {
-                        case SCHRO_CHROMA_444:
-                            frame = schro_frame_new_and_alloc(NULL, SCHRO_FRAME_FORMAT_U8_444,
-                                                              h->format->width, h->format->height);
-                            break;
-                        case SCHRO_CHROMA_422:
-                            frame = schro_frame_new_and_alloc(NULL, SCHRO_FRAME_FORMAT_U8_422,
-                                                              h->format->width, h->format->height);
-                            break;
-                        case SCHRO_CHROMA_420:
-                            frame = schro_frame_new_and_alloc(NULL, SCHRO_FRAME_FORMAT_U8_420,
-                                                              h->format->width, h->format->height);
-                            break;
-                        default:
-                            printf("ERROR: unsupported chroma format\n");
-                            return -1;
+                    if ((frame = get_frame(&h->spare, h->format)) == NULL) {
+                        printf("ERROR: unsupported chroma format\n");
+                        return -1;
                     }
                     schro_decoder_add_output_picture(h->schro, frame);
                     break;
@@ -141,15 +647,13 @@ int read_frame_dirac(handle_t handle, picture_t *pic, int framenum)
                         frame = schro_decoder_pull(h->schro);
                         if (dts != framenum) {
                             /* This shouldn't happen, why does it? */
-                            schro_frame_unref(frame);
+                            put_frame(&h->spare, frame);
                             break;
                         }
 
-                        memcpy(pic->img.plane[0], frame->components[0].data, frame->components[0].length);
-                        memcpy(pic->img.plane[1], frame->components[1].data, frame->components[1].length);
-                        memcpy(pic->img.plane[2], frame->components[2].data, frame->components[2].length);
+                        copy_frame(pic, frame);
 
-                        schro_frame_unref(frame);
+                        put_frame(&h->spare, frame);
                         return 0;
                     }
                     break;
@@ -162,7 +666,7 @@ int read_frame_dirac(handle_t handle, picture_t *pic, int framenum)
             }
         }
 
-        if (parse_packet(h, &packet, &size)) {
+        if (parse_packet(h->fp, &packet, &size)) {
             break;
         }
 
@@ -170,6 +674,8 @@ int read_frame_dirac(handle_t handle, picture_t *pic, int framenum)
             /* Unexpected EOF */
             schro_decoder_push_end_of_stream(h->schro);
             return -1;
+        } else if (drop_picture(h, packet, size)) {
+            free(packet);
         } else {
             buffer = schro_buffer_new_with_data(packet, size);
             buffer->free = buffer_free;
@@ -185,8 +691,16 @@ int read_frame_dirac(handle_t handle, picture_t *pic, int framenum)
 int close_file_dirac(handle_t handle)
 {
     dirac_input_t *h = handle;
+
     if (!h || !h->fp || !h->schro || !h->format)
         return 0;
+
+    if (h->threads)
+        stop_workers(h, h->thread_cnt);
+    free_parallel(h);
+
+    flush_frames(&h->spare);
+    free(h->frames);
     fclose(h->fp);
     free(h->format);
     schro_decoder_free(h->schro);
@@ -195,15 +709,15 @@ int close_file_dirac(handle_t handle)
 }
 
 /* From schroedinger-tools */
-int parse_packet(dirac_input_t * h, uint8_t **data, int *pkt_size)
+static int parse_packet(FILE *fp, uint8_t **data, int *pkt_size)
 {
     uint8_t *packet;
     uint8_t header[13];
     int n;
     int size;
 
-    n = fread(header, 1, 13, h->fp);
-    if (feof(h->fp)) {
+    n = fread(header, 1, 13, fp);
+    if (feof(fp)) {
         *data = NULL;
         *pkt_size = 0;
         return 0;
@@ -233,7 +747,7 @@ int parse_packet(dirac_input_t * h, uint8_t **data, int *pkt_size)
 
     packet = malloc(size);
     memcpy(packet, header, 13);
-    n = fread(packet + 13, 1, size - 13, h->fp);
+    n = fread(packet + 13, 1, size - 13, fp);
     if (n < size - 13) {
         free(packet);
         return -1;
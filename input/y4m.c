@@ -26,22 +26,29 @@
 #include <inttypes.h>
 #include <malloc.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "common.h"
 #include "utils.h"
+#include "picture.h"
 #include "y4m.h"
+#include "zran.h"
 
 /* Most of this is from x264 */
 
-/* YUV4MPEG2 raw 420 yuv file operation */
+/* YUV4MPEG2 raw yuv file operation */
 typedef struct {
     FILE *fp;
+    zran_t *gz;
     int width, height;
     int par_width, par_height;
     int next_frame;
     int seq_header_len, frame_header_len;
     int frame_size;
+    int seekable;
     int csp;
+    int depth;
+    int plane_cnt;          /* read, the rest are skipped */
     int fps_num, fps_den;
 } y4m_input_t;
 
@@ -50,15 +57,115 @@ typedef struct {
 #define Y4M_FRAME_MAGIC "FRAME"
 #define MAX_FRAME_HEADER 80
 
+/* Reads go through these so gzip compressed input can be handled the same */
+static int y4m_getc(y4m_input_t *h)
+{
+    if (h->gz)
+        return zran_getc(h->gz);
+    return fgetc(h->fp);
+}
+
+static int y4m_read(y4m_input_t *h, void *buf, int len)
+{
+    if (h->gz)
+        return zran_read(h->gz, buf, len);
+    return fread(buf, 1, len, h->fp);
+}
+
+static int y4m_seek(y4m_input_t *h, uint64_t offset)
+{
+    if (h->gz)
+        return zran_seek(h->gz, offset);
+    return fseeko(h->fp, offset, SEEK_SET);
+}
+
+/* Forward over bytes that aren't wanted, a pipe has to be read through */
+static int y4m_skip(y4m_input_t *h, uint64_t from, uint64_t to)
+{
+    uint8_t buf[65536];
+
+    if (h->seekable)
+        return y4m_seek(h, to);
+
+    while (from < to) {
+        int n = to - from < sizeof(buf) ? to - from : sizeof(buf);
+        if (y4m_read(h, buf, n) != n)
+            return -1;
+        from += n;
+    }
+    return 0;
+}
+
+/* A C tag such as 420jpeg, 422, 444p10 or mono */
+static int parse_csp(char *tok, int *csp, int *depth, const char **name)
+{
+    static const struct {
+        const char *name;
+        int csp;
+        const char *deep;       /* before a bit depth, NULL if there can't be one */
+    } csps[] = {
+        { "420jpeg", COLORSPACE_420, NULL },
+        { "420paldv", COLORSPACE_420, NULL },
+        { "420mpeg2", COLORSPACE_420, NULL },
+        { "420", COLORSPACE_420, "p" },
+        { "422", COLORSPACE_422, "p" },
+        { "444alpha", COLORSPACE_444A, NULL },
+        { "444", COLORSPACE_444, "p" },
+        { "mono", COLORSPACE_400, "" },
+    };
+    char *end;
+    int i;
+
+    for (i = 0; i < sizeof(csps) / sizeof(*csps); i++) {
+        char *p = tok + strlen(csps[i].name);
+
+        if (strncmp(csps[i].name, tok, p - tok))
+            continue;
+
+        *csp = csps[i].csp;
+        *depth = 8;
+        *name = csps[i].name;
+        if (*p == 0x20 || *p == '\n')
+            return 0;
+
+        if (csps[i].deep && !strncmp(csps[i].deep, p, strlen(csps[i].deep))) {
+            *depth = strtol(p + strlen(csps[i].deep), &end, 10);
+            if ((*end == 0x20 || *end == '\n') && *depth >= 9 && *depth <= 16)
+                return 0;
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+static int read_plane(y4m_input_t *h, uint8_t *dst, int stride, int row_size, int rows)
+{
+    int i;
+
+    if (stride == row_size)
+        return y4m_read(h, dst, row_size * rows) == row_size * rows ? 0 : -1;
+
+    for (i = 0; i < rows; i++, dst += stride)
+        if (y4m_read(h, dst, row_size) != row_size)
+            return -1;
+
+    return 0;
+}
+
 int open_file_y4m(char *filename, handle_t *handle, config_t *config)
 {
     int i, n, d;
-    int interlaced;
+    const char *csp_name = NULL;
     char header[MAX_YUV4_HEADER + 10];
     char *tokstart, *tokend, *header_end;
+    uint8_t magic[2];
+    struct stat sb;
     y4m_input_t *h = calloc(1, sizeof(*h));
 
     h->next_frame = 0;
+    h->csp = COLORSPACE_420;
+    h->depth = 8;
 
     if (!strcmp(filename, "-"))
         h->fp = stdin;
@@ -67,11 +174,24 @@ int open_file_y4m(char *filename, handle_t *handle, config_t *config)
     if (h->fp == NULL)
         return -1;
 
+    /* A pipe or a FIFO has to be read through, whatever its name */
+    h->seekable = fstat(fileno(h->fp), &sb) == 0 && S_ISREG(sb.st_mode);
+
+    /* gzip compressed, go through the access point index */
+    if (h->seekable && fread(magic, 1, 2, h->fp) == 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        fclose(h->fp);
+        h->fp = NULL;
+        if (zran_open(filename, &h->gz))
+            return -1;
+    } else if (h->seekable) {
+        rewind(h->fp);
+    }
+
     h->frame_header_len = strlen(Y4M_FRAME_MAGIC) + 1;
 
     /* Read header */
     for (i = 0; i < MAX_YUV4_HEADER; i++) {
-        header[i] = fgetc(h->fp);
+        header[i] = y4m_getc(h);
         if (header[i] == '\n') {
             /* Add a space after last option. Makes parsing "444" vs
                "444alpha" easier. */
@@ -99,25 +219,17 @@ int open_file_y4m(char *filename, handle_t *handle, config_t *config)
                 tokstart = tokend;
                 break;
             case 'C':              /* Color space */
-                if (strncmp("420", tokstart, 3)) {
+                if (parse_csp(tokstart, &h->csp, &h->depth, &csp_name)) {
                     fprintf(stderr, "Colorspace unhandled\n");
                     return -1;
                 }
                 tokstart = strchr(tokstart, 0x20);
                 break;
             case 'I':              /* Interlace type */
-                switch (*tokstart++) {
-                    case 'p':
-                        interlaced = 0;
-                        break;
-                    case '?':
-                    case 't':
-                    case 'b':
-                    case 'm':
-                    default:
-                        interlaced = 1;
-                        fprintf(stderr, "Warning, this sequence might be interlaced\n");
-                }
+                if (*tokstart && strchr("ptbm?", *tokstart))
+                    config->interlace = *tokstart;
+                if (*tokstart++ != 'p')
+                    fprintf(stderr, "Warning, this sequence might be interlaced\n");
                 break;
             case 'F': /* Frame rate - 0:0 if unknown */
                       /* Frame rate in unimportant. */
@@ -141,9 +253,13 @@ int open_file_y4m(char *filename, handle_t *handle, config_t *config)
                 if (!strncmp("YSCSS=", tokstart, 6)) {
                     /* Older nonstandard pixel format representation */
                     tokstart += 6;
-                    if (strncmp("420JPEG", tokstart, 7) &&
-                         strncmp("420MPEG2", tokstart, 8) &&
-                         strncmp("420PALDV", tokstart, 8)) {
+                    if (!strncmp("420JPEG", tokstart, 7))
+                        csp_name = "420jpeg";
+                    else if (!strncmp("420MPEG2", tokstart, 8))
+                        csp_name = "420mpeg2";
+                    else if (!strncmp("420PALDV", tokstart, 8))
+                        csp_name = "420paldv";
+                    else {
                         fprintf(stderr, "Unsupported extended colorspace\n");
                         return -1;
                     }
@@ -153,9 +269,36 @@ int open_file_y4m(char *filename, handle_t *handle, config_t *config)
         }
     }
 
-    fprintf(stderr, "yuv4mpeg: %ix%i@%i/%ifps, %i:%i\n",
+    config->fps_num = h->fps_num;
+    config->fps_den = h->fps_den;
+    config->sar_width = h->par_width;
+    config->sar_height = h->par_height;
+    config->frame_refs = h->seekable && !h->gz && !config->luma_only;
+
+    if (h->depth > 8)
+        h->csp |= COLORSPACE_HIGH_DEPTH;
+    h->plane_cnt = csp_plane_cnt(h->csp);
+    config->csp = h->csp;
+    config->bit_depth = h->depth;
+    if (h->csp == COLORSPACE_420)
+        config->chroma_siting = csp_name;
+
+    /* Chroma is never read, the pictures don't even have planes for it */
+    if (config->luma_only) {
+        h->plane_cnt = 1;
+        config->csp = COLORSPACE_400 | (h->csp & COLORSPACE_HIGH_DEPTH);
+    }
+
+    h->frame_size = 0;
+    for (i = 0; i < csp_plane_cnt(h->csp); i++) {
+        int row_size, rows;
+        csp_plane_size(h->csp, i, h->width, h->height, &row_size, &rows);
+        h->frame_size += row_size * rows;
+    }
+
+    fprintf(stderr, "yuv4mpeg: %ix%i@%i/%ifps, %i:%i, %i-bit\n",
             h->width, h->height, h->fps_num, h->fps_den,
-            h->par_width, h->par_height);
+            h->par_width, h->par_height, h->depth);
 
     *handle = (handle_t)h;
     return 0;
@@ -165,17 +308,22 @@ int read_frame_y4m(handle_t handle, picture_t *pic, int framenum)
 {
     int slen = strlen(Y4M_FRAME_MAGIC);
     int i = 0;
+    int partial;
     char header[16];
+    uint64_t offset, end;
     y4m_input_t *h = handle;
 
+    offset = (uint64_t)framenum * (h->frame_size + h->frame_header_len) + h->seq_header_len;
     if (framenum != h->next_frame) {
-        if (fseek(h->fp, (uint64_t)framenum*(3*(h->width*h->height)/2+h->frame_header_len)
-             + h->seq_header_len, SEEK_SET))
+        uint64_t pos = (uint64_t)h->next_frame * (h->frame_size + h->frame_header_len) + h->seq_header_len;
+        if (!h->seekable && framenum < h->next_frame)
+            return -1;
+        if (y4m_skip(h, pos, offset))
             return -1;
     }
 
     /* Read frame header - without terminating '\n' */
-    if (fread(header, 1, slen, h->fp) != slen)
+    if (y4m_read(h, header, slen) != slen)
         return -1;
 
     header[slen] = 0;
@@ -186,17 +334,53 @@ int read_frame_y4m(handle_t handle, picture_t *pic, int framenum)
     }
 
     /* Skip most of it */
-    while (i < MAX_FRAME_HEADER && fgetc(h->fp) != '\n')
+    while (i < MAX_FRAME_HEADER && y4m_getc(h) != '\n')
         i++;
     if (i == MAX_FRAME_HEADER) {
         fprintf(stderr, "Bad frame header!\n");
         return -1;
     }
     h->frame_header_len = i + slen + 1;
+    offset += h->frame_header_len;
+    end = offset + h->frame_size;
+
+    pic->ref.fd = -1;
+    if (h->seekable && !h->gz && h->plane_cnt == csp_plane_cnt(h->csp)) {
+        pic->ref.fd = fileno(h->fp);
+        pic->ref.offset = offset;
+        pic->ref.size = h->frame_size;
+    }
+
+    /* Only read the rows inside the region of interest when we can seek */
+    partial = h->seekable && (pic->roi.y != 0 || pic->roi.height != h->height);
+
+    for (i = 0; i < h->plane_cnt; i++) {
+        int row_size, rows, first = 0, cnt;
+        int stride = pic->img.stride[i];
+
+        csp_plane_size(h->csp, i, h->width, h->height, &row_size, &rows);
+        cnt = rows;
+        if (partial) {
+            csp_plane_size(h->csp, i, h->width, pic->roi.y, &row_size, &first);
+            csp_plane_size(h->csp, i, h->width, pic->roi.height, &row_size, &cnt);
+            if (y4m_seek(h, offset + (uint64_t)first * row_size))
+                return -1;
+        }
 
-    if (fread(pic->img.plane[0], 1, h->width*h->height, h->fp) <= 0
-        || fread(pic->img.plane[1], 1, h->width * h->height / 4, h->fp) <= 0
-        || fread(pic->img.plane[2], 1, h->width * h->height / 4, h->fp) <= 0)
+        if (read_plane(h, pic->img.plane[i] + first * stride, stride, row_size, cnt))
+            return -1;
+
+        /* Widen to the MSB aligned samples the rest of the pipeline expects */
+        if (h->depth > 8 && h->depth < 16) {
+            int y;
+            for (y = first; y < first + cnt; y++)
+                samples_msb_align(pic->img.plane[i] + y * stride, row_size / 2, h->depth);
+        }
+
+        offset += (uint64_t)row_size * rows;
+    }
+
+    if ((partial || offset != end) && y4m_skip(h, offset, end))
         return -1;
 
     pic->pts = framenum;
@@ -208,9 +392,12 @@ int read_frame_y4m(handle_t handle, picture_t *pic, int framenum)
 int close_file_y4m(handle_t handle)
 {
     y4m_input_t *h = handle;
-    if (!h || !h->fp)
+    if (!h || (!h->fp && !h->gz))
         return 0;
-    fclose(h->fp);
+    if (h->gz)
+        zran_close(h->gz);
+    else
+        fclose(h->fp);
     free(h);
     return 0;
 }
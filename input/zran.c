@@ -0,0 +1,419 @@
+/*****************************************************************************
+* zran.c: random access into gzip compressed files.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*          Mark Adler (zran.c from the zlib examples)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "zran.h"
+
+/* An access point is a deflate block boundary in the compressed stream,
+ * together with the 32K of uncompressed data preceding it. Inflation can be
+ * restarted from any of them by priming a raw inflater with the bit offset
+ * and the window as a preset dictionary.
+ *
+ * The windows are kept out of memory, in the sidecar index file next to the
+ * input (or an anonymous temporary file if that can't be written). Only the
+ * small point table is held in memory. The sidecar layout is:
+ *
+ *   header | window 0 | window 1 | ... | point table
+ */
+
+#define WINSIZE 32768
+#define CHUNK 65536
+#define ZIDX_MAGIC "FSZIDX01"
+
+typedef struct {
+    uint64_t out;           /* offset in uncompressed data */
+    uint64_t in;            /* offset in compressed file of first full byte */
+    int32_t bits;           /* number of bits (1-7) from byte at in - 1, or 0 */
+    int32_t reserved;
+} zran_point_t;
+
+typedef struct {
+    char magic[8];
+    uint64_t gz_size;
+    int64_t gz_mtime;
+    uint32_t span;
+    uint32_t point_cnt;
+    uint64_t table_offset;
+} zran_header_t;
+
+struct zran_t {
+    FILE *fp;               /* compressed input */
+    FILE *idx;              /* window storage */
+    int point_cnt;
+    zran_point_t *points;
+
+    /* Current position of the streaming inflater */
+    z_stream strm;
+    int active;
+    uint64_t pos;           /* uncompressed offset the inflater has reached */
+    uint64_t want;          /* offset the next read starts at */
+    uint8_t in[CHUNK];
+    uint8_t scratch[WINSIZE];
+};
+
+static int load_index(zran_t *z, FILE *idx, struct stat *sb)
+{
+    zran_header_t hdr;
+
+    if (fread(&hdr, sizeof(hdr), 1, idx) != 1
+        || memcmp(hdr.magic, ZIDX_MAGIC, sizeof(hdr.magic))
+        || hdr.gz_size != sb->st_size || hdr.gz_mtime != sb->st_mtime
+        || hdr.point_cnt == 0)
+        return -1;
+
+    if ((z->points = malloc(hdr.point_cnt * sizeof(*z->points))) == NULL)
+        return -1;
+
+    if (fseeko(idx, hdr.table_offset, SEEK_SET)
+        || fread(z->points, sizeof(*z->points), hdr.point_cnt, idx) != hdr.point_cnt) {
+        free(z->points);
+        z->points = NULL;
+        return -1;
+    }
+
+    z->point_cnt = hdr.point_cnt;
+    z->idx = idx;
+    return 0;
+}
+
+static int add_point(zran_t *z, int bits, uint64_t in, uint64_t out, unsigned left, uint8_t *window)
+{
+    zran_point_t *next;
+
+    if ((z->point_cnt & 255) == 0) {
+        next = realloc(z->points, (z->point_cnt + 256) * sizeof(*z->points));
+        if (next == NULL)
+            return -1;
+        z->points = next;
+    }
+
+    next = &z->points[z->point_cnt++];
+    memset(next, 0, sizeof(*next));
+    next->bits = bits;
+    next->in = in;
+    next->out = out;
+
+    /* The window is circular, store it unrolled */
+    if (left && fwrite(window + WINSIZE - left, 1, left, z->idx) != left)
+        return -1;
+    if (left < WINSIZE && fwrite(window, 1, WINSIZE - left, z->idx) != WINSIZE - left)
+        return -1;
+
+    return 0;
+}
+
+/* Decompress the whole file once, recording an access point roughly every
+ * ZRAN_SPAN bytes. Mostly straight from zran.c. */
+static int build_index(zran_t *z, struct stat *sb)
+{
+    z_stream strm;
+    zran_header_t hdr;
+    uint64_t totin = 0, totout = 0, last = 0;
+    uint8_t *window;
+    int ret;
+
+    if ((window = malloc(WINSIZE)) == NULL)
+        return -1;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 47) != Z_OK) {      /* gzip decoding */
+        free(window);
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    fwrite(&hdr, sizeof(hdr), 1, z->idx);
+
+    strm.avail_out = 0;
+    do {
+        strm.avail_in = fread(z->in, 1, CHUNK, z->fp);
+        if (ferror(z->fp)) {
+            ret = Z_ERRNO;
+            goto done;
+        }
+        if (strm.avail_in == 0) {
+            ret = Z_DATA_ERROR;
+            goto done;
+        }
+        strm.next_in = z->in;
+
+        do {
+            if (strm.avail_out == 0) {
+                strm.avail_out = WINSIZE;
+                strm.next_out = window;
+            }
+
+            totin += strm.avail_in;
+            totout += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK);
+            totin -= strm.avail_in;
+            totout -= strm.avail_out;
+            if (ret == Z_NEED_DICT)
+                ret = Z_DATA_ERROR;
+            if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+                goto done;
+            if (ret == Z_STREAM_END)
+                break;
+
+            /* At the end of a block (but not the last one) */
+            if ((strm.data_type & 128) && !(strm.data_type & 64)
+                && (totout == 0 || totout - last > ZRAN_SPAN)) {
+                if (add_point(z, strm.data_type & 7, totin, totout, strm.avail_out, window)) {
+                    ret = Z_MEM_ERROR;
+                    goto done;
+                }
+                last = totout;
+            }
+        } while (strm.avail_in != 0);
+    } while (ret != Z_STREAM_END);
+
+    if (strm.avail_in || fgetc(z->fp) != EOF)
+        fprintf(stderr, "warning: ignoring data after the first gzip member\n");
+
+    memcpy(hdr.magic, ZIDX_MAGIC, sizeof(hdr.magic));
+    hdr.gz_size = sb->st_size;
+    hdr.gz_mtime = sb->st_mtime;
+    hdr.span = ZRAN_SPAN;
+    hdr.point_cnt = z->point_cnt;
+    hdr.table_offset = sizeof(hdr) + (uint64_t)z->point_cnt * WINSIZE;
+
+    if (fwrite(z->points, sizeof(*z->points), z->point_cnt, z->idx) != z->point_cnt
+        || fseeko(z->idx, 0, SEEK_SET)
+        || fwrite(&hdr, sizeof(hdr), 1, z->idx) != 1
+        || fflush(z->idx))
+        ret = Z_ERRNO;
+    else
+        ret = Z_OK;
+
+done:
+    inflateEnd(&strm);
+    free(window);
+
+    return ret == Z_OK && z->point_cnt ? 0 : -1;
+}
+
+int zran_open(char *filename, zran_t **handle)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct stat sb;
+    FILE *idx;
+    zran_t *z;
+    int kept = 1;
+
+    if ((z = calloc(1, sizeof(*z))) == NULL)
+        return -1;
+
+    if ((z->fp = fopen(filename, "rb")) == NULL || fstat(fileno(z->fp), &sb) < 0)
+        goto error;
+
+    snprintf(path, PATH_MAX, "%s%s", filename, ZRAN_INDEX_EXT);
+
+    if ((idx = fopen(path, "rb")) != NULL && load_index(z, idx, &sb)) {
+        fclose(idx);
+        idx = NULL;
+    }
+
+    /* Built next to the sidecar and renamed over it, so an interrupted run
+     * never leaves a torn one behind */
+    if (idx == NULL) {
+        fprintf(stderr, "zran: building access point index for '%s'\n", filename);
+        snprintf(tmp, PATH_MAX, "%s.tmp", path);
+        if ((z->idx = fopen(tmp, "w+b")) == NULL) {
+            fprintf(stderr, "warning: could not write '%s', index will not be kept\n", path);
+            kept = 0;
+            if ((z->idx = tmpfile()) == NULL)
+                goto error;
+        }
+        if (build_index(z, &sb)) {
+            fprintf(stderr, "ERROR: could not index compressed input\n");
+            fclose(z->idx);
+            if (kept)
+                unlink(tmp);
+            z->idx = NULL;
+            goto error;
+        }
+        /* The windows are still read through the open file either way */
+        if (kept && rename(tmp, path)) {
+            fprintf(stderr, "warning: could not write '%s', index will not be kept\n", path);
+            unlink(tmp);
+        }
+    }
+
+    *handle = z;
+    return 0;
+
+error:
+    if (z->fp)
+        fclose(z->fp);
+    free(z->points);
+    free(z);
+    return -1;
+}
+
+/* Index of the last access point at or before offset */
+static int find_point(zran_t *z, uint64_t offset)
+{
+    int lo = 0, hi = z->point_cnt - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (z->points[mid].out <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+static int restart(zran_t *z, int idx)
+{
+    zran_point_t *p = &z->points[idx];
+    int ret;
+
+    if (z->active)
+        inflateEnd(&z->strm);
+    z->active = 0;
+
+    memset(&z->strm, 0, sizeof(z->strm));
+    if (inflateInit2(&z->strm, -15) != Z_OK)        /* raw inflate */
+        return -1;
+    z->active = 1;
+
+    if (fseeko(z->fp, p->in - (p->bits ? 1 : 0), SEEK_SET))
+        return -1;
+    if (p->bits) {
+        if ((ret = fgetc(z->fp)) == EOF)
+            return -1;
+        inflatePrime(&z->strm, p->bits, ret >> (8 - p->bits));
+    }
+
+    if (fseeko(z->idx, sizeof(zran_header_t) + (uint64_t)idx * WINSIZE, SEEK_SET)
+        || fread(z->scratch, 1, WINSIZE, z->idx) != WINSIZE)
+        return -1;
+    inflateSetDictionary(&z->strm, z->scratch, WINSIZE);
+
+    z->pos = p->out;
+    return 0;
+}
+
+/* Produce len bytes from the current position, into out or discarded */
+static int inflate_bytes(zran_t *z, uint8_t *out, int len)
+{
+    int done = 0;
+    int ret;
+
+    while (done < len) {
+        int n = len - done;
+
+        if (out) {
+            z->strm.next_out = out + done;
+        } else {
+            if (n > WINSIZE)
+                n = WINSIZE;
+            z->strm.next_out = z->scratch;
+        }
+        z->strm.avail_out = n;
+
+        if (z->strm.avail_in == 0) {
+            z->strm.avail_in = fread(z->in, 1, CHUNK, z->fp);
+            if (ferror(z->fp) || z->strm.avail_in == 0)
+                break;
+            z->strm.next_in = z->in;
+        }
+
+        ret = inflate(&z->strm, Z_NO_FLUSH);
+        n -= z->strm.avail_out;
+        done += n;
+        z->pos += n;
+
+        if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+            fprintf(stderr, "ERROR: corrupt compressed input\n");
+            break;
+        }
+        if (ret == Z_STREAM_END)
+            break;
+    }
+
+    return done;
+}
+
+int zran_seek(zran_t *z, uint64_t offset)
+{
+    z->want = offset;
+    return 0;
+}
+
+int zran_read(zran_t *z, void *buf, int len)
+{
+    int idx = find_point(z, z->want);
+    int n;
+
+    /* Carry on from where the inflater is unless an access point is
+     * closer to the wanted offset. */
+    if (!z->active || z->want < z->pos || z->points[idx].out > z->pos) {
+        if (restart(z, idx))
+            return -1;
+    }
+
+    if (z->want > z->pos) {
+        int skip = z->want - z->pos;
+        if (inflate_bytes(z, NULL, skip) != skip)
+            return 0;
+    }
+
+    n = inflate_bytes(z, buf, len);
+    z->want = z->pos;
+
+    return n;
+}
+
+int zran_getc(zran_t *z)
+{
+    uint8_t c;
+    if (zran_read(z, &c, 1) != 1)
+        return EOF;
+    return c;
+}
+
+int zran_close(zran_t *z)
+{
+    if (!z)
+        return 0;
+    if (z->active)
+        inflateEnd(&z->strm);
+    fclose(z->fp);
+    fclose(z->idx);
+    free(z->points);
+    free(z);
+    return 0;
+}
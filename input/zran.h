@@ -0,0 +1,34 @@
+/*****************************************************************************
+* zran.h: random access into gzip compressed files.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+/* Distance between access points, in uncompressed bytes */
+#define ZRAN_SPAN (4 << 20)
+/* Suffix of the sidecar file holding the access point index */
+#define ZRAN_INDEX_EXT ".zidx"
+
+typedef struct zran_t zran_t;
+
+int zran_open(char *filename, zran_t **z);
+int zran_seek(zran_t *z, uint64_t offset);
+int zran_read(zran_t *z, void *buf, int len);
+int zran_getc(zran_t *z);
+int zran_close(zran_t *z);
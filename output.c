@@ -21,110 +21,239 @@
 *****************************************************************************/
 
 #include <stdint.h>
-#include <malloc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include <libavutil/avutil.h>
 #include <libswscale/swscale.h>
-#include <png.h>
 
 #include "common.h"
 #include "output.h"
+#include "picture.h"
 
-typedef struct {
-    FILE *fp;
-    png_structp png;
-    png_infop info;
-} png_output_t;
+static const output_driver_t png_output = {
+    "png", "png", open_file_png, write_image_png, close_file_png, OUTPUT_TUNABLE
+};
 
-int open_file_png(char *filename, handle_t *handle, int compression)
-{
-    png_output_t *h = NULL;
-    if ((h = calloc(1, sizeof(*h))) == NULL)
-        return -1;
+static const output_driver_t fastpng_output = {
+    "fastpng", "png", open_file_fastpng, write_image_fastpng, close_file_fastpng, OUTPUT_TUNABLE
+};
 
-    if (!strcmp(filename, "-"))
-        h->fp = stdout;
-    else if ((h->fp = fopen(filename, "wb")) == NULL) {
-        goto error;
-    }
+static const output_driver_t qoi_output = {
+    "qoi", "qoi", open_file_qoi, write_image_qoi, close_file_qoi, 0
+};
 
-    if ((h->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL) {
-        goto error;
-    }
+static const output_driver_t pam_output = {
+    "pam", "pam", open_file_pam, write_image_pnm, close_file_pnm, 0
+};
 
-    if ((h->info = png_create_info_struct(h->png)) == NULL) {
-        png_destroy_write_struct(&(h->png), (png_infopp) NULL);
-        goto error;
-    }
+static const output_driver_t ppm_output = {
+    "ppm", "ppm", open_file_ppm, write_image_pnm, close_file_pnm, 0
+};
 
-    png_init_io(h->png, h->fp);
+static const output_driver_t y4m_output = {
+    "y4m", "y4m", open_file_yuv4mpeg, write_image_yuv, close_file_yuv, OUTPUT_STREAM | OUTPUT_RAW
+};
 
-    png_set_compression_level(h->png, compression);
+static const output_driver_t yuv_output = {
+    "yuv", "yuv", open_file_yuv, write_image_yuv, close_file_yuv, OUTPUT_STREAM | OUTPUT_RAW
+};
 
-    *handle = h;
+static const output_driver_t shm_rgb_output = {
+    "shm-rgb", "rgb", open_file_shm_rgb, write_image_shm, close_file_shm, OUTPUT_STREAM
+};
 
-    return 0;
+static const output_driver_t shm_yuv_output = {
+    "shm-yuv", "yuv", open_file_shm_yuv, write_image_shm, close_file_shm, OUTPUT_STREAM
+};
 
-error:
-    if (h->fp != NULL && h->fp != stdout)
-        fclose(h->fp);
-    free(h);
+#ifdef HAVE_JPEG
+static const output_driver_t jpeg_output = {
+    "jpeg", "jpg", open_file_jpeg, write_image_jpeg, close_file_jpeg, 0
+};
+#endif
 
-    return -1;
+/* First one is the default */
+const output_driver_t *output_drivers[] = {
+    &png_output,
+    &fastpng_output,
+    &qoi_output,
+    &pam_output,
+    &ppm_output,
+    &y4m_output,
+    &yuv_output,
+    &shm_rgb_output,
+    &shm_yuv_output,
+#ifdef HAVE_JPEG
+    &jpeg_output,
+#endif
+    NULL
+};
+
+const output_driver_t *output_find(const char *name)
+{
+    int i;
+    for (i = 0; output_drivers[i]; i++)
+        if (!strcasecmp(output_drivers[i]->name, name))
+            return output_drivers[i];
+    return NULL;
 }
 
-int close_file_png(handle_t handle)
+/* The packed RGB format that keeps the most of the source, out of those
+ * the driver takes */
+int output_rgb_csp(config_t *config, int caps)
 {
-    int ret = 0;
-    png_output_t *h = handle;
+    int csp = COLORSPACE_RGB;
 
-    png_destroy_write_struct(&(h->png), &(h->info));
+    /* Already converted, e.g. a contact sheet */
+    if ((config->csp & COLORSPACE_MASK) >= COLORSPACE_RGB)
+        return config->csp;
+
+    if ((config->csp & COLORSPACE_MASK) == COLORSPACE_444A && (caps & OUTPUT_RGB_ALPHA))
+        csp = COLORSPACE_RGBA;
+    if ((config->csp & COLORSPACE_HIGH_DEPTH) && (caps & OUTPUT_RGB_DEEP))
+        csp |= COLORSPACE_HIGH_DEPTH;
+
+    return csp;
+}
 
-    if ((h->fp == NULL) || (h->fp == stdout))
-        return ret;
+/* Conversion contexts are recycled like pictures: the drivers may run on
+ * several threads at once, each takes one for its geometry and puts it
+ * back when done. */
 
-    ret = fclose(h->fp);
+typedef struct scaler_t {
+    int src_csp, dst_csp, width, height;
+    struct SwsContext *ctx;
+    struct scaler_t *next;
+} scaler_t;
 
-    free(h);
+static pthread_mutex_t scaler_lock = PTHREAD_MUTEX_INITIALIZER;
+static scaler_t *scalers;
 
-    return ret;
+static scaler_t *scaler_get(int src_csp, int dst_csp, int width, int height)
+{
+    scaler_t *s, **prev;
+
+    pthread_mutex_lock(&scaler_lock);
+    for (prev = &scalers; (s = *prev) != NULL; prev = &s->next) {
+        if (s->src_csp == src_csp && s->dst_csp == dst_csp && s->width == width && s->height == height) {
+            *prev = s->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&scaler_lock);
+
+    if (s)
+        return s;
+
+    if ((s = malloc(sizeof(*s))) == NULL)
+        return NULL;
+    s->src_csp = src_csp;
+    s->dst_csp = dst_csp;
+    s->width = width;
+    s->height = height;
+    s->ctx = sws_getContext(width, height, csp_pix_fmt(src_csp),
+                            width, height, csp_pix_fmt(dst_csp),
+                            SWS_FAST_BILINEAR | SWS_ACCURATE_RND,
+                            NULL, NULL, NULL);
+    if (s->ctx == NULL) {
+        free(s);
+        return NULL;
+    }
+
+    return s;
 }
 
-int write_image_png(handle_t handle, picture_t *pic, config_t *config)
+static void scaler_put(scaler_t *s)
 {
-    png_output_t *h = handle;
-    uint8_t *out_data = malloc(config->width * config->height * 4);
-    uint8_t **rows = calloc(config->height, sizeof(*rows));
-    picture_t pic_out;
-    struct SwsContext *sws_ctx;
-    int i;
+    pthread_mutex_lock(&scaler_lock);
+    s->next = scalers;
+    scalers = s;
+    pthread_mutex_unlock(&scaler_lock);
+}
+
+void output_pool_flush(void)
+{
+    scaler_t *s;
 
-    pic_out.img.plane[0] = out_data;
-    pic_out.img.plane[1] = pic_out.img.plane[2] = pic_out.img.plane[3] = NULL;
-    pic_out.img.stride[0] = 3 * config->width;
-    pic_out.img.stride[1] = pic_out.img.stride[2] = pic_out.img.stride[3] = 0;
+    pthread_mutex_lock(&scaler_lock);
+    while ((s = scalers) != NULL) {
+        scalers = s->next;
+        sws_freeContext(s->ctx);
+        free(s);
+    }
+    pthread_mutex_unlock(&scaler_lock);
+}
+
+/* Convert the cropped picture to packed rows of csp at dst */
+static int scale_packed(picture_t *pic, config_t *config, int csp, uint8_t *dst, int dst_stride)
+{
+    rect_t *crop = &config->crop;
+    scaler_t *scaler;
+    uint8_t *src[4];
+    uint8_t *dst_plane[4] = { dst };
+    int dst_strides[4] = { dst_stride };
+    int row_size, rows, y;
+
+    picture_crop(pic, config->csp, crop, src);
+
+    if (config->csp == csp) {
+        csp_plane_size(csp, 0, crop->width, crop->height, &row_size, &rows);
+        for (y = 0; y < rows; y++)
+            memcpy(dst + y * dst_stride, src[0] + y * pic->img.stride[0], row_size);
+        return 0;
+    }
 
-    sws_ctx = sws_getContext(config->width, config->height, PIX_FMT_YUV420P,
-                             config->width, config->height, PIX_FMT_RGB24,
-                             SWS_FAST_BILINEAR | SWS_ACCURATE_RND,
-                             NULL, NULL, NULL);
+    if ((scaler = scaler_get(config->csp, csp, crop->width, crop->height)) == NULL)
+        return -1;
 
-    sws_scale(sws_ctx, pic->img.plane, pic->img.stride, 0, config->height, pic_out.img.plane, pic_out.img.stride);
+    sws_scale(scaler->ctx, src, pic->img.stride, 0, crop->height, dst_plane, dst_strides);
+    scaler_put(scaler);
 
     __asm__ volatile ("emms\n\t");
 
-    png_set_IHDR(h->png, h->info, config->width, config->height,
-                 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    return 0;
+}
 
-    for (i = 0; i < config->height; i++)
-        rows[i] = pic_out.img.plane[0] + i * pic_out.img.stride[0];
+/* Convert the cropped picture to packed 8-bit RGB rows at dst */
+int output_scale_rgb(picture_t *pic, config_t *config, uint8_t *dst, int dst_stride)
+{
+    return scale_packed(pic, config, COLORSPACE_RGB, dst, dst_stride);
+}
 
-    png_set_rows(h->png, h->info, rows);
+/* Packed rows of the cropped picture for the drivers that need them.
+ * *out is set to the converted picture, to be released by the caller, or
+ * NULL when pic already was csp. */
+int output_convert(picture_t *pic, config_t *config, int csp, uint8_t **data, int *stride, picture_t **out)
+{
+    rect_t *crop = &config->crop;
+    uint8_t *src[4];
+
+    *out = NULL;
 
-    png_write_png(h->png, h->info, 0, NULL);
+    if (config->csp == csp) {
+        picture_crop(pic, config->csp, crop, src);
+        *data = src[0];
+        *stride = pic->img.stride[0];
+        return 0;
+    }
 
-    free(rows);
-    free(out_data);
+    if ((*out = picture_get(csp, crop->width, crop->height)) == NULL)
+        return -1;
+
+    if (scale_packed(pic, config, csp, (*out)->img.plane[0], (*out)->img.stride[0])) {
+        picture_release(*out);
+        return -1;
+    }
+
+    *data = (*out)->img.plane[0];
+    *stride = (*out)->img.stride[0];
 
     return 0;
 }
+
+int output_convert_rgb(picture_t *pic, config_t *config, uint8_t **data, int *stride, picture_t **rgb)
+{
+    return output_convert(pic, config, COLORSPACE_RGB, data, stride, rgb);
+}
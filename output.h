@@ -20,6 +20,56 @@
 * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
 *****************************************************************************/
 
-int open_file_png(char *filename, handle_t *handle, int compression);
-int write_image_png(handle_t handle, picture_t *pic, config_t *config);
-int close_file_png(handle_t handle);
+typedef struct {
+    /* zlib compression level, -1 for the default */
+    int zlevel;
+    /* JPEG quality, 1-100 */
+    int quality;
+    /* zlib strategy, or OUTPUT_STRATEGY_AUTO */
+    int strategy;
+    /* PNG filter type for every row, or one of OUTPUT_FILTER_* */
+    int filter;
+} output_param_t;
+
+/* Whatever the driver does at zlevel */
+#define OUTPUT_STRATEGY_AUTO   -1
+#define OUTPUT_FILTER_AUTO     -1
+/* The cheapest looking filter for each row */
+#define OUTPUT_FILTER_ADAPTIVE  5
+
+/* All frames are written to one file, opened once per run */
+#define OUTPUT_STREAM 0x1
+/* Can copy frames straight from the input, see picture_t ref */
+#define OUTPUT_RAW    0x2
+/* Follows strategy and filter as well as zlevel */
+#define OUTPUT_TUNABLE 0x4
+
+typedef struct {
+    const char *name;
+    const char *ext;
+    int (*open_file) (char *filename, handle_t *handle, output_param_t *param);
+    int (*write_image) (handle_t handle, picture_t *pic, config_t *config);
+    int (*close_file) (handle_t handle);
+    int flags;
+} output_driver_t;
+
+/* Packed RGB a driver can take besides 8 bits per sample, see output_rgb_csp */
+#define OUTPUT_RGB_DEEP  0x1
+#define OUTPUT_RGB_ALPHA 0x2
+
+extern const output_driver_t *output_drivers[];
+
+const output_driver_t *output_find(const char *name);
+int output_rgb_csp(config_t *config, int caps);
+int output_scale_rgb(picture_t *pic, config_t *config, uint8_t *dst, int dst_stride);
+int output_convert(picture_t *pic, config_t *config, int csp, uint8_t **data, int *stride, picture_t **out);
+int output_convert_rgb(picture_t *pic, config_t *config, uint8_t **data, int *stride, picture_t **rgb);
+void output_pool_flush(void);
+
+#include "output/png.h"
+#include "output/fastpng.h"
+#include "output/qoi.h"
+#include "output/pnm.h"
+#include "output/jpeg.h"
+#include "output/yuv.h"
+#include "output/shm.h"
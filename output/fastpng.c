@@ -0,0 +1,274 @@
+/*****************************************************************************
+* fastpng.c: In-tree PNG output driver.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "output.h"
+#include "picture.h"
+#include "output/pngfilter.h"
+
+/* A PNG writer without libpng, so the row filters can use SIMD and the
+ * deflate settings can follow the compression level:
+ *
+ *   -z 0     no filter, stored deflate blocks
+ *   -z 1     Up filter only, run length deflate
+ *   -z 2-9   per row choice of the filter with the smallest sum of absolute
+ *            differences, Z_FILTERED deflate at that level (the libpng
+ *            defaults)
+ *
+ * unless the strategy or filter are given. */
+
+#define IDAT_SIZE (1 << 16)
+
+static const uint8_t png_signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+
+typedef struct {
+    FILE *fp;
+    int zlevel, strategy, filter;
+    pngfilter_func_t pf;
+    z_stream strm;
+    uint8_t out[IDAT_SIZE];
+} fastpng_output_t;
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static int write_chunk(FILE *fp, const char *type, const uint8_t *data, uint32_t len)
+{
+    uint8_t hdr[8], crc[4];
+    uLong sum;
+
+    put_be32(hdr, len);
+    memcpy(hdr + 4, type, 4);
+    /* crc32() with a NULL buffer returns the initial value, not crc */
+    sum = crc32(0, hdr + 4, 4);
+    if (len)
+        sum = crc32(sum, data, len);
+    put_be32(crc, sum);
+
+    if (fwrite(hdr, 1, 8, fp) != 8 || (len && fwrite(data, 1, len, fp) != len)
+        || fwrite(crc, 1, 4, fp) != 4)
+        return -1;
+    return 0;
+}
+
+/* Deflate len bytes, writing an IDAT each time the output buffer fills */
+static int deflate_data(fastpng_output_t *h, const uint8_t *data, int len, int flush)
+{
+    z_stream *strm = &h->strm;
+    int ret;
+
+    strm->next_in = (uint8_t *)data;
+    strm->avail_in = len;
+
+    do {
+        ret = deflate(strm, flush);
+        if (ret == Z_STREAM_ERROR)
+            return -1;
+        if (strm->avail_out == 0 || ret == Z_STREAM_END) {
+            if (write_chunk(h->fp, "IDAT", h->out, IDAT_SIZE - strm->avail_out))
+                return -1;
+            strm->next_out = h->out;
+            strm->avail_out = IDAT_SIZE;
+        }
+    } while (strm->avail_in || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+    return 0;
+}
+
+/* Little endian 16-bit samples to the big endian PNG wants */
+static void swap16(uint8_t *dst, const uint8_t *src, int len)
+{
+    int i;
+    for (i = 0; i < len; i += 2) {
+        dst[i] = src[i + 1];
+        dst[i + 1] = src[i];
+    }
+}
+
+/* swap is set when 16-bit samples are little endian */
+static int encode_png(fastpng_output_t *h, uint8_t *data, int stride, int width, int height,
+                      int color_type, int depth, int channels, int swap)
+{
+    pngfilter_func_t *pf = &h->pf;
+    int bpp = (channels * depth + 7) / 8;
+    int len = width * channels * depth / 8;
+    uint8_t ihdr[13];
+    uint8_t *buf, *zero, *swapped[2], *rows[PNGF_CNT];
+    int f, y, ret = -1;
+
+    /* One filtered row per filter type, each behind its filter type byte,
+     * then a zero row and two byte swapped ones */
+    if ((buf = calloc(PNGF_CNT + 3, len + 1)) == NULL)
+        return -1;
+    zero = buf + PNGF_CNT * (len + 1);
+    swapped[0] = zero + len + 1;
+    swapped[1] = swapped[0] + len + 1;
+    for (f = 0; f < PNGF_CNT; f++) {
+        rows[f] = buf + f * (len + 1);
+        rows[f][0] = f;
+    }
+
+    memset(&h->strm, 0, sizeof(h->strm));
+    if (deflateInit2(&h->strm, h->zlevel, Z_DEFLATED, 15, 8, h->strategy) != Z_OK) {
+        free(buf);
+        return -1;
+    }
+    h->strm.next_out = h->out;
+    h->strm.avail_out = IDAT_SIZE;
+
+    put_be32(ihdr, width);
+    put_be32(ihdr + 4, height);
+    ihdr[8] = depth;
+    ihdr[9] = color_type;
+    ihdr[10] = 0;               /* deflate */
+    ihdr[11] = 0;               /* adaptive filtering */
+    ihdr[12] = 0;               /* no interlace */
+
+    if (fwrite(png_signature, 1, 8, h->fp) != 8 || write_chunk(h->fp, "IHDR", ihdr, 13))
+        goto done;
+
+    for (y = 0; y < height; y++) {
+        const uint8_t *cur = data + y * stride;
+        const uint8_t *prev = y ? cur - stride : zero;
+        int best = h->filter;
+
+        if (swap) {
+            swap16(swapped[y & 1], cur, len);
+            cur = swapped[y & 1];
+            prev = y ? swapped[!(y & 1)] : zero;
+        }
+
+        if (best == PNGF_NONE) {
+            memcpy(rows[PNGF_NONE] + 1, cur, len);
+        } else if (best != OUTPUT_FILTER_ADAPTIVE) {
+            pf->filter[best](rows[best] + 1, cur, prev, len, bpp);
+        } else {
+            uint32_t cost, best_cost = pf->cost(cur, len);
+            best = PNGF_NONE;
+            memcpy(rows[PNGF_NONE] + 1, cur, len);
+            for (f = PNGF_SUB; f < PNGF_CNT; f++) {
+                pf->filter[f](rows[f] + 1, cur, prev, len, bpp);
+                if ((cost = pf->cost(rows[f] + 1, len)) < best_cost) {
+                    best_cost = cost;
+                    best = f;
+                }
+            }
+        }
+
+        if (deflate_data(h, rows[best], len + 1, Z_NO_FLUSH))
+            goto done;
+    }
+
+    if (deflate_data(h, NULL, 0, Z_FINISH) || write_chunk(h->fp, "IEND", NULL, 0))
+        goto done;
+
+    ret = 0;
+
+done:
+    deflateEnd(&h->strm);
+    free(buf);
+
+    return ret;
+}
+
+int open_file_fastpng(char *filename, handle_t *handle, output_param_t *param)
+{
+    fastpng_output_t *h;
+
+    if ((h = calloc(1, sizeof(*h))) == NULL)
+        return -1;
+
+    if (!strcmp(filename, "-"))
+        h->fp = stdout;
+    else if ((h->fp = fopen(filename, "wb")) == NULL) {
+        free(h);
+        return -1;
+    }
+
+    /* zlib's default level */
+    h->zlevel = param->zlevel < 0 ? 6 : param->zlevel;
+    h->strategy = h->zlevel == 0 ? Z_DEFAULT_STRATEGY : h->zlevel == 1 ? Z_RLE : Z_FILTERED;
+    h->filter = h->zlevel == 0 ? PNGF_NONE : h->zlevel == 1 ? PNGF_UP : OUTPUT_FILTER_ADAPTIVE;
+    if (param->strategy != OUTPUT_STRATEGY_AUTO)
+        h->strategy = param->strategy;
+    if (param->filter != OUTPUT_FILTER_AUTO)
+        h->filter = param->filter;
+    pngfilter_init(&h->pf);
+
+    *handle = h;
+    return 0;
+}
+
+int write_image_fastpng(handle_t handle, picture_t *pic, config_t *config)
+{
+    fastpng_output_t *h = handle;
+    uint8_t *data;
+    int stride;
+    picture_t *rgb;
+    uint8_t *src[4];
+    int csp = output_rgb_csp(config, OUTPUT_RGB_DEEP | OUTPUT_RGB_ALPHA);
+    int alpha = (csp & COLORSPACE_MASK) == COLORSPACE_RGBA;
+    int deep = csp & COLORSPACE_HIGH_DEPTH;
+    int ret;
+
+    /* Color type 0 is grayscale, written straight from the luma plane */
+    if ((config->csp & COLORSPACE_MASK) == COLORSPACE_400) {
+        deep = config->csp & COLORSPACE_HIGH_DEPTH;
+        picture_crop(pic, config->csp, &config->crop, src);
+        return encode_png(h, src[0], pic->img.stride[0], config->crop.width, config->crop.height,
+                          0, deep ? 16 : 8, 1, deep);
+    }
+
+    if (output_convert(pic, config, csp, &data, &stride, &rgb))
+        return -1;
+
+    /* Color type 2 is RGB, 6 RGBA. 16-bit samples are already big endian. */
+    ret = encode_png(h, data, stride, config->crop.width, config->crop.height,
+                     alpha ? 6 : 2, deep ? 16 : 8, alpha ? 4 : 3, 0);
+
+    picture_release(rgb);
+
+    return ret;
+}
+
+int close_file_fastpng(handle_t handle)
+{
+    fastpng_output_t *h = handle;
+    int ret = 0;
+
+    if (h->fp != stdout)
+        ret = fclose(h->fp);
+    free(h);
+
+    return ret;
+}
@@ -0,0 +1,297 @@
+/*****************************************************************************
+* jpeg.c: JPEG output driver.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+#include "common.h"
+#include "output.h"
+#include "picture.h"
+
+/* YUV pictures are handed to libjpeg as raw downsampled YCbCr planes, so
+ * there is no colour conversion or chroma resampling on either side. JFIF
+ * is full range while Y4M is limited range like everywhere else here, so
+ * the rows are expanded through a table on the way in. */
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} jpeg_error_t;
+
+typedef struct {
+    FILE *fp;
+    int quality;
+    int failed;
+    struct jpeg_compress_struct cinfo;
+    jpeg_error_t jerr;
+    uint8_t lut[2][256];        /* luma, chroma */
+    uint8_t *rows;              /* expanded MCU rows */
+    int rows_size;
+    picture_t *tmp;             /* converted picture being written */
+} jpeg_output_t;
+
+/* libjpeg would exit(), unwind to write_image_jpeg instead */
+static void error_exit(j_common_ptr cinfo)
+{
+    jpeg_error_t *err = (jpeg_error_t *)cinfo->err;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(err->jmp, 1);
+}
+
+/* 16-235 luma and 16-240 chroma to 0-255 */
+static void init_lut(jpeg_output_t *h)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        int y = ((i - 16) * 255 * 2 + 219) / (2 * 219);
+        int c = (i - 128) * 255;
+        c = 128 + (c >= 0 ? (c + 112) / 224 : -((112 - c) / 224));
+        h->lut[0][i] = y < 0 ? 0 : y > 255 ? 255 : y;
+        h->lut[1][i] = c < 0 ? 0 : c > 255 ? 255 : c;
+    }
+}
+
+/* len samples through lut, then repeat the last one up to padded */
+static void expand_row(uint8_t *dst, const uint8_t *src, int len, int padded, const uint8_t *lut)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        dst[i] = lut[src[i]];
+    for (; i < padded; i++)
+        dst[i] = dst[len - 1];
+}
+
+static int alloc_rows(jpeg_output_t *h, int size)
+{
+    if (size > h->rows_size) {
+        free(h->rows);
+        if ((h->rows = malloc(size)) == NULL) {
+            h->rows_size = 0;
+            return -1;
+        }
+        h->rows_size = size;
+    }
+    return 0;
+}
+
+int open_file_jpeg(char *filename, handle_t *handle, output_param_t *param)
+{
+    jpeg_output_t *h;
+
+    if ((h = calloc(1, sizeof(*h))) == NULL)
+        return -1;
+
+    if (!strcmp(filename, "-"))
+        h->fp = stdout;
+    else if ((h->fp = fopen(filename, "wb")) == NULL) {
+        free(h);
+        return -1;
+    }
+
+    h->quality = param->quality;
+    h->cinfo.err = jpeg_std_error(&h->jerr.pub);
+    h->jerr.pub.error_exit = error_exit;
+    jpeg_create_compress(&h->cinfo);
+    init_lut(h);
+    jpeg_stdio_dest(&h->cinfo, h->fp);
+
+    *handle = h;
+    return 0;
+}
+
+static int write_raw(jpeg_output_t *h, picture_t *pic, int csp, rect_t *crop)
+{
+    struct jpeg_compress_struct *cinfo = &h->cinfo;
+    JSAMPROW rows[3][2 * DCTSIZE];
+    JSAMPARRAY planes[3] = { rows[0], rows[1], rows[2] };
+    uint8_t *src[4], *dst;
+    int width[3], padded[3], height[3], mcu_rows[3];
+    int i, y;
+
+    /* 4:2:0 is 2x2 luma blocks per MCU, 4:2:2 2x1 and 4:4:4 1x1 */
+    cinfo->comp_info[0].h_samp_factor = csp == COLORSPACE_420 || csp == COLORSPACE_422 ? 2 : 1;
+    cinfo->comp_info[0].v_samp_factor = csp == COLORSPACE_420 ? 2 : 1;
+    for (i = 1; i < 3; i++)
+        cinfo->comp_info[i].h_samp_factor = cinfo->comp_info[i].v_samp_factor = 1;
+    cinfo->raw_data_in = TRUE;
+
+    picture_crop(pic, csp, crop, src);
+    for (i = y = 0; i < 3; i++) {
+        csp_plane_size(csp, i, crop->width, crop->height, &width[i], &height[i]);
+        /* libjpeg reads whole MCUs, at most 16 samples wide */
+        padded[i] = ALIGN(width[i], 2 * DCTSIZE);
+        mcu_rows[i] = cinfo->comp_info[i].v_samp_factor * DCTSIZE;
+        y += padded[i] * mcu_rows[i];
+    }
+    if (alloc_rows(h, y))
+        return -1;
+
+    jpeg_start_compress(cinfo, TRUE);
+
+    /* Rows past the bottom repeat the last one */
+    for (y = 0; y < height[0]; y += mcu_rows[0]) {
+        dst = h->rows;
+        for (i = 0; i < 3; i++) {
+            int first = y / mcu_rows[0] * mcu_rows[i];
+            int j;
+            for (j = 0; j < mcu_rows[i]; j++, dst += padded[i]) {
+                int row = first + j < height[i] ? first + j : height[i] - 1;
+                expand_row(dst, src[i] + row * pic->img.stride[i], width[i], padded[i], h->lut[!!i]);
+                rows[i][j] = dst;
+            }
+        }
+        jpeg_write_raw_data(cinfo, planes, mcu_rows[0]);
+    }
+
+    jpeg_finish_compress(cinfo);
+
+    return 0;
+}
+
+/* Single component scanlines straight from the luma plane */
+static int write_gray(jpeg_output_t *h, picture_t *pic, config_t *config)
+{
+    struct jpeg_compress_struct *cinfo = &h->cinfo;
+    rect_t *crop = &config->crop;
+    uint8_t *src[4];
+    JSAMPROW row;
+    int stride, y;
+
+    cinfo->input_components = 1;
+    cinfo->in_color_space = JCS_GRAYSCALE;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, h->quality, TRUE);
+
+    if (config->csp & COLORSPACE_HIGH_DEPTH) {
+        if ((h->tmp = picture_pack8(pic, config->csp, crop)) == NULL)
+            return -1;
+        src[0] = h->tmp->img.plane[0];
+        stride = h->tmp->img.stride[0];
+    } else {
+        picture_crop(pic, config->csp, crop, src);
+        stride = pic->img.stride[0];
+    }
+    if (alloc_rows(h, crop->width))
+        return -1;
+
+    jpeg_start_compress(cinfo, TRUE);
+    for (y = 0; y < crop->height; y++) {
+        expand_row(h->rows, src[0] + y * stride, crop->width, crop->width, h->lut[0]);
+        row = h->rows;
+        jpeg_write_scanlines(cinfo, &row, 1);
+    }
+    jpeg_finish_compress(cinfo);
+
+    return 0;
+}
+
+static int write_image(jpeg_output_t *h, picture_t *pic, config_t *config)
+{
+    struct jpeg_compress_struct *cinfo = &h->cinfo;
+    rect_t *crop = &config->crop;
+    JSAMPROW row;
+    uint8_t *data;
+    int stride, y;
+    rect_t full;
+
+    cinfo->image_width = crop->width;
+    cinfo->image_height = crop->height;
+
+    if ((config->csp & COLORSPACE_MASK) == COLORSPACE_400)
+        return write_gray(h, pic, config);
+
+    cinfo->input_components = 3;
+    cinfo->in_color_space = config->csp == COLORSPACE_RGB ? JCS_RGB : JCS_YCbCr;
+
+    jpeg_set_defaults(cinfo);
+    jpeg_set_colorspace(cinfo, JCS_YCbCr);
+    jpeg_set_quality(cinfo, h->quality, TRUE);
+
+    /* Baseline JPEG is 8-bit only */
+    if (config->csp & COLORSPACE_HIGH_DEPTH) {
+        if ((h->tmp = picture_pack8(pic, config->csp, crop)) == NULL)
+            return -1;
+        full.x = full.y = 0;
+        full.width = crop->width;
+        full.height = crop->height;
+        return write_raw(h, h->tmp, config->csp & COLORSPACE_MASK, &full);
+    }
+
+    if (config->csp != COLORSPACE_RGB)
+        return write_raw(h, pic, config->csp, crop);
+
+    /* Contact sheets are already RGB */
+    if (output_convert_rgb(pic, config, &data, &stride, &h->tmp))
+        return -1;
+
+    jpeg_start_compress(cinfo, TRUE);
+    for (y = 0; y < crop->height; y++) {
+        row = data + y * stride;
+        jpeg_write_scanlines(cinfo, &row, 1);
+    }
+    jpeg_finish_compress(cinfo);
+
+    return 0;
+}
+
+int write_image_jpeg(handle_t handle, picture_t *pic, config_t *config)
+{
+    jpeg_output_t *h = handle;
+    int ret = -1;
+
+    if (setjmp(h->jerr.jmp))
+        jpeg_abort_compress(&h->cinfo);
+    else
+        ret = write_image(h, pic, config);
+
+    picture_release(h->tmp);
+    h->tmp = NULL;
+    if (ret)
+        h->failed = 1;
+
+    return ret;
+}
+
+int close_file_jpeg(handle_t handle)
+{
+    jpeg_output_t *h = handle;
+    int ret = 0;
+
+    jpeg_destroy_compress(&h->cinfo);
+    if (h->fp != stdout)
+        ret = fclose(h->fp);
+    if (h->failed)
+        ret = -1;
+    free(h->rows);
+    free(h);
+
+    return ret;
+}
@@ -0,0 +1,27 @@
+/*****************************************************************************
+* jpeg.h: JPEG output driver.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#define JPEG_DEFAULT_QUALITY 85
+
+int open_file_jpeg(char *filename, handle_t *handle, output_param_t *param);
+int write_image_jpeg(handle_t handle, picture_t *pic, config_t *config);
+int close_file_jpeg(handle_t handle);
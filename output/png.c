@@ -0,0 +1,139 @@
+/*****************************************************************************
+* png.c: PNG output driver.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <malloc.h>
+#include <string.h>
+#include <png.h>
+
+#include "common.h"
+#include "output.h"
+#include "picture.h"
+
+typedef struct {
+    FILE *fp;
+    png_structp png;
+    png_infop info;
+} png_output_t;
+
+int open_file_png(char *filename, handle_t *handle, output_param_t *param)
+{
+    png_output_t *h = NULL;
+    if ((h = calloc(1, sizeof(*h))) == NULL)
+        return -1;
+
+    if (!strcmp(filename, "-"))
+        h->fp = stdout;
+    else if ((h->fp = fopen(filename, "wb")) == NULL) {
+        goto error;
+    }
+
+    if ((h->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL) {
+        goto error;
+    }
+
+    if ((h->info = png_create_info_struct(h->png)) == NULL) {
+        png_destroy_write_struct(&(h->png), (png_infopp) NULL);
+        goto error;
+    }
+
+    png_init_io(h->png, h->fp);
+
+    png_set_compression_level(h->png, param->zlevel);
+    if (param->strategy != OUTPUT_STRATEGY_AUTO)
+        png_set_compression_strategy(h->png, param->strategy);
+    if (param->filter == OUTPUT_FILTER_ADAPTIVE)
+        png_set_filter(h->png, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
+    else if (param->filter != OUTPUT_FILTER_AUTO)
+        png_set_filter(h->png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE << param->filter);
+
+    *handle = h;
+
+    return 0;
+
+error:
+    if (h->fp != NULL && h->fp != stdout)
+        fclose(h->fp);
+    free(h);
+
+    return -1;
+}
+
+int close_file_png(handle_t handle)
+{
+    int ret = 0;
+    png_output_t *h = handle;
+
+    png_destroy_write_struct(&(h->png), &(h->info));
+
+    if ((h->fp == NULL) || (h->fp == stdout))
+        return ret;
+
+    ret = fclose(h->fp);
+
+    free(h);
+
+    return ret;
+}
+
+int write_image_png(handle_t handle, picture_t *pic, config_t *config)
+{
+    png_output_t *h = handle;
+    rect_t *crop = &config->crop;
+    uint8_t *data;
+    int stride;
+    picture_t *rgb = NULL;
+    uint8_t *src[4];
+    int csp = output_rgb_csp(config, OUTPUT_RGB_DEEP | OUTPUT_RGB_ALPHA);
+    int color_type = (csp & COLORSPACE_MASK) == COLORSPACE_RGBA ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+    int swap = 0;
+    int i;
+
+    /* Luma is written as it is, 16-bit samples are little endian */
+    if ((config->csp & COLORSPACE_MASK) == COLORSPACE_400) {
+        picture_crop(pic, config->csp, crop, src);
+        data = src[0];
+        stride = pic->img.stride[0];
+        csp = config->csp;
+        color_type = PNG_COLOR_TYPE_GRAY;
+        swap = csp & COLORSPACE_HIGH_DEPTH;
+    } else if (output_convert(pic, config, csp, &data, &stride, &rgb)) {
+        return -1;
+    }
+
+    png_set_IHDR(h->png, h->info, crop->width, crop->height,
+                 csp & COLORSPACE_HIGH_DEPTH ? 16 : 8, color_type,
+                 PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+    /* Row by row, so there is no row pointer array to allocate */
+    png_write_info(h->png, h->info);
+    if (swap)
+        png_set_swap(h->png);
+    for (i = 0; i < crop->height; i++)
+        png_write_row(h->png, data + i * stride);
+    png_write_end(h->png, h->info);
+
+    picture_release(rgb);
+
+    return 0;
+}
@@ -0,0 +1,329 @@
+/*****************************************************************************
+* pngfilter.c: PNG row filters.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#include "pngfilter.h"
+
+/* Encoding only ever looks at unfiltered bytes, so unlike decoding none of
+ * the filters carry a dependency from one pixel to the next and all of them
+ * vectorise. The first bpp bytes of a row have no left neighbour and are
+ * always done in C. */
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2 * c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+static void filter_none_c(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    memcpy(dst, cur, len);
+}
+
+static void filter_sub_c(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    int i;
+    for (i = 0; i < bpp && i < len; i++)
+        dst[i] = cur[i];
+    for (; i < len; i++)
+        dst[i] = cur[i] - cur[i - bpp];
+}
+
+static void filter_up_c(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    int i;
+    for (i = 0; i < len; i++)
+        dst[i] = cur[i] - prev[i];
+}
+
+static void filter_avg_c(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    int i;
+    for (i = 0; i < bpp && i < len; i++)
+        dst[i] = cur[i] - (prev[i] >> 1);
+    for (; i < len; i++)
+        dst[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1);
+}
+
+static void filter_paeth_c(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    int i;
+    for (i = 0; i < bpp && i < len; i++)
+        dst[i] = cur[i] - prev[i];
+    for (; i < len; i++)
+        dst[i] = cur[i] - paeth(cur[i - bpp], prev[i], prev[i - bpp]);
+}
+
+static uint32_t cost_c(const uint8_t *row, int len)
+{
+    uint32_t sum = 0;
+    int i;
+    for (i = 0; i < len; i++)
+        sum += abs((int8_t)row[i]);
+    return sum;
+}
+
+#ifdef HAVE_X86
+/* SSE2 is part of x86-64, AVX2 is picked at runtime */
+
+static void filter_sub_sse2(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    int i;
+    for (i = 0; i < bpp && i < len; i++)
+        dst[i] = cur[i];
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(cur + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(cur + i - bpp));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi8(x, a));
+    }
+    for (; i < len; i++)
+        dst[i] = cur[i] - cur[i - bpp];
+}
+
+static void filter_up_sse2(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    int i;
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(cur + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi8(x, b));
+    }
+    for (; i < len; i++)
+        dst[i] = cur[i] - prev[i];
+}
+
+static void filter_avg_sse2(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    const __m128i one = _mm_set1_epi8(1);
+    int i;
+    for (i = 0; i < bpp && i < len; i++)
+        dst[i] = cur[i] - (prev[i] >> 1);
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(cur + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(cur + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+        /* pavgb rounds up, PNG rounds down */
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi8(x, avg));
+    }
+    for (; i < len; i++)
+        dst[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1);
+}
+
+static inline __m128i paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    __m128i not_a, not_b;
+
+    pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+    pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+    not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    not_b = _mm_cmpgt_epi16(pb, pc);
+    c = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+    return _mm_or_si128(_mm_and_si128(not_a, c), _mm_andnot_si128(not_a, a));
+}
+
+static void filter_paeth_sse2(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i;
+    for (i = 0; i < bpp && i < len; i++)
+        dst[i] = cur[i] - prev[i];
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(cur + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(cur + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+        __m128i c = _mm_loadu_si128((const __m128i *)(prev + i - bpp));
+        __m128i lo = paeth_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero),
+                                _mm_unpacklo_epi8(c, zero));
+        __m128i hi = paeth_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero),
+                                _mm_unpackhi_epi8(c, zero));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_sub_epi8(x, _mm_packus_epi16(lo, hi)));
+    }
+    for (; i < len; i++)
+        dst[i] = cur[i] - paeth(cur[i - bpp], prev[i], prev[i - bpp]);
+}
+
+static uint32_t cost_sse2(const uint8_t *row, int len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    uint32_t ret;
+    int i;
+
+    /* |(int8_t)x| is min(x, -x) taken unsigned */
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+        x = _mm_min_epu8(x, _mm_sub_epi8(zero, x));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(x, zero));
+    }
+    ret = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+
+    return ret + cost_c(row + i, len - i);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+static AVX2 void filter_sub_avx2(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    int i;
+    for (i = 0; i < bpp && i < len; i++)
+        dst[i] = cur[i];
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(cur + i));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(cur + i - bpp));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_sub_epi8(x, a));
+    }
+    for (; i < len; i++)
+        dst[i] = cur[i] - cur[i - bpp];
+}
+
+static AVX2 void filter_up_avx2(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    int i;
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(cur + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(prev + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_sub_epi8(x, b));
+    }
+    for (; i < len; i++)
+        dst[i] = cur[i] - prev[i];
+}
+
+static AVX2 void filter_avg_avx2(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    const __m256i one = _mm256_set1_epi8(1);
+    int i;
+    for (i = 0; i < bpp && i < len; i++)
+        dst[i] = cur[i] - (prev[i] >> 1);
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(cur + i));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(cur + i - bpp));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(prev + i));
+        __m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_sub_epi8(x, avg));
+    }
+    for (; i < len; i++)
+        dst[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1);
+}
+
+static inline AVX2 __m256i paeth_avx2(__m256i a, __m256i b, __m256i c)
+{
+    __m256i pa = _mm256_sub_epi16(b, c);
+    __m256i pb = _mm256_sub_epi16(a, c);
+    __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+    __m256i not_a, not_b;
+
+    pa = _mm256_abs_epi16(pa);
+    pb = _mm256_abs_epi16(pb);
+
+    not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+    not_b = _mm256_cmpgt_epi16(pb, pc);
+    return _mm256_blendv_epi8(a, _mm256_blendv_epi8(b, c, not_b), not_a);
+}
+
+static AVX2 void filter_paeth_avx2(uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int i;
+    for (i = 0; i < bpp && i < len; i++)
+        dst[i] = cur[i] - prev[i];
+    /* unpack and pack both work within 128-bit lanes, so the order comes
+     * back out right */
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(cur + i));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(cur + i - bpp));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(prev + i));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(prev + i - bpp));
+        __m256i lo = paeth_avx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero),
+                                _mm256_unpacklo_epi8(c, zero));
+        __m256i hi = paeth_avx2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero),
+                                _mm256_unpackhi_epi8(c, zero));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_sub_epi8(x, _mm256_packus_epi16(lo, hi)));
+    }
+    for (; i < len; i++)
+        dst[i] = cur[i] - paeth(cur[i - bpp], prev[i], prev[i - bpp]);
+}
+
+static AVX2 uint32_t cost_avx2(const uint8_t *row, int len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum = zero;
+    __m128i sum128;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_abs_epi8(_mm256_loadu_si256((const __m256i *)(row + i)));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(x, zero));
+    }
+    sum128 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    sum128 = _mm_add_epi64(sum128, _mm_unpackhi_epi64(sum128, sum128));
+
+    return _mm_cvtsi128_si32(sum128) + cost_sse2(row + i, len - i);
+}
+#endif
+
+void pngfilter_init(pngfilter_func_t *pf)
+{
+    pf->filter[PNGF_NONE] = filter_none_c;
+    pf->filter[PNGF_SUB] = filter_sub_c;
+    pf->filter[PNGF_UP] = filter_up_c;
+    pf->filter[PNGF_AVG] = filter_avg_c;
+    pf->filter[PNGF_PAETH] = filter_paeth_c;
+    pf->cost = cost_c;
+
+#ifdef HAVE_X86
+    pf->filter[PNGF_SUB] = filter_sub_sse2;
+    pf->filter[PNGF_UP] = filter_up_sse2;
+    pf->filter[PNGF_AVG] = filter_avg_sse2;
+    pf->filter[PNGF_PAETH] = filter_paeth_sse2;
+    pf->cost = cost_sse2;
+
+    if (__builtin_cpu_supports("avx2")) {
+        pf->filter[PNGF_SUB] = filter_sub_avx2;
+        pf->filter[PNGF_UP] = filter_up_avx2;
+        pf->filter[PNGF_AVG] = filter_avg_avx2;
+        pf->filter[PNGF_PAETH] = filter_paeth_avx2;
+        pf->cost = cost_avx2;
+    }
+#endif
+}
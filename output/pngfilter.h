@@ -0,0 +1,45 @@
+/*****************************************************************************
+* pngfilter.h: PNG row filters.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#ifndef PNGFILTER_H
+#define PNGFILTER_H
+
+enum {
+    PNGF_NONE,
+    PNGF_SUB,
+    PNGF_UP,
+    PNGF_AVG,
+    PNGF_PAETH,
+    PNGF_CNT
+};
+
+typedef struct {
+    /* dst = filtered cur, prev is the unfiltered row above (zeros for the
+     * first row), bpp is bytes per complete pixel */
+    void (*filter[PNGF_CNT]) (uint8_t *dst, const uint8_t *cur, const uint8_t *prev, int len, int bpp);
+    /* Sum of the absolute values of a filtered row taken as signed bytes */
+    uint32_t (*cost) (const uint8_t *row, int len);
+} pngfilter_func_t;
+
+void pngfilter_init(pngfilter_func_t *pf);
+
+#endif
@@ -0,0 +1,115 @@
+/*****************************************************************************
+* pnm.c: PAM and PPM output drivers.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "output.h"
+#include "picture.h"
+
+/* Netpbm formats: a short text header followed by raw samples */
+
+typedef struct {
+    FILE *fp;
+    int pam;
+} pnm_output_t;
+
+static int open_file_pnm(char *filename, handle_t *handle, int pam)
+{
+    pnm_output_t *h;
+
+    if ((h = calloc(1, sizeof(*h))) == NULL)
+        return -1;
+
+    if (!strcmp(filename, "-"))
+        h->fp = stdout;
+    else if ((h->fp = fopen(filename, "wb")) == NULL) {
+        free(h);
+        return -1;
+    }
+    h->pam = pam;
+
+    *handle = h;
+    return 0;
+}
+
+int open_file_pam(char *filename, handle_t *handle, output_param_t *param)
+{
+    return open_file_pnm(filename, handle, 1);
+}
+
+int open_file_ppm(char *filename, handle_t *handle, output_param_t *param)
+{
+    return open_file_pnm(filename, handle, 0);
+}
+
+int write_image_pnm(handle_t handle, picture_t *pic, config_t *config)
+{
+    pnm_output_t *h = handle;
+    rect_t *crop = &config->crop;
+    uint8_t *data;
+    int stride;
+    picture_t *rgb;
+    /* Samples wider than 8 bits are big endian in both */
+    int csp = output_rgb_csp(config, h->pam ? OUTPUT_RGB_DEEP | OUTPUT_RGB_ALPHA : OUTPUT_RGB_DEEP);
+    int alpha = (csp & COLORSPACE_MASK) == COLORSPACE_RGBA;
+    int maxval = csp & COLORSPACE_HIGH_DEPTH ? 65535 : 255;
+    int row_size, rows, y, ret = 0;
+
+    if (output_convert(pic, config, csp, &data, &stride, &rgb))
+        return -1;
+    csp_plane_size(csp, 0, crop->width, crop->height, &row_size, &rows);
+
+    if (h->pam)
+        fprintf(h->fp, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+                crop->width, crop->height, alpha ? 4 : 3, maxval, alpha ? "RGB_ALPHA" : "RGB");
+    else
+        fprintf(h->fp, "P6\n%u %u\n%d\n", crop->width, crop->height, maxval);
+
+    if (stride == row_size) {
+        if (fwrite(data, row_size, rows, h->fp) != rows)
+            ret = -1;
+    } else {
+        for (y = 0; y < rows; y++)
+            if (fwrite(data + y * stride, 1, row_size, h->fp) != row_size)
+                ret = -1;
+    }
+
+    picture_release(rgb);
+
+    return ret;
+}
+
+int close_file_pnm(handle_t handle)
+{
+    pnm_output_t *h = handle;
+    int ret = 0;
+
+    if (h->fp != stdout)
+        ret = fclose(h->fp);
+    free(h);
+
+    return ret;
+}
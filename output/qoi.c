@@ -0,0 +1,183 @@
+/*****************************************************************************
+* qoi.c: QOI output driver.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "output.h"
+#include "picture.h"
+
+/* The "Quite OK Image" format, see https://qoiformat.org/qoi-specification.pdf
+ * Lossless, one pass and no entropy coding, so it encodes several times
+ * faster than deflate. */
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+
+#define QOI_HASH(r, g, b) (((r) * 3 + (g) * 5 + (b) * 7 + 255 * 11) & 63)
+
+typedef struct {
+    FILE *fp;
+} qoi_output_t;
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+int open_file_qoi(char *filename, handle_t *handle, output_param_t *param)
+{
+    qoi_output_t *h;
+
+    if ((h = calloc(1, sizeof(*h))) == NULL)
+        return -1;
+
+    if (!strcmp(filename, "-"))
+        h->fp = stdout;
+    else if ((h->fp = fopen(filename, "wb")) == NULL) {
+        free(h);
+        return -1;
+    }
+
+    *handle = h;
+    return 0;
+}
+
+int write_image_qoi(handle_t handle, picture_t *pic, config_t *config)
+{
+    static const uint8_t padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    qoi_output_t *h = handle;
+    rect_t *crop = &config->crop;
+    uint32_t index[64];
+    uint8_t header[14];
+    uint8_t *data, *buf, *out;
+    uint8_t pr = 0, pg = 0, pb = 0;
+    int stride, run = 0;
+    picture_t *rgb;
+    int x, y, ret = 0;
+
+    /* Worst case is 4 bytes per pixel, flushed a row at a time */
+    if ((buf = malloc(crop->width * 4 + 1)) == NULL)
+        return -1;
+    if (output_convert_rgb(pic, config, &data, &stride, &rgb)) {
+        free(buf);
+        return -1;
+    }
+
+    memcpy(header, "qoif", 4);
+    put_be32(header + 4, crop->width);
+    put_be32(header + 8, crop->height);
+    header[12] = 3;         /* RGB */
+    header[13] = 0;         /* sRGB with linear alpha */
+    fwrite(header, 1, sizeof(header), h->fp);
+
+    memset(index, 0, sizeof(index));
+
+    for (y = 0; y < crop->height; y++) {
+        uint8_t *px = data + y * stride;
+
+        for (x = 0, out = buf; x < crop->width; x++, px += 3) {
+            uint8_t r = px[0], g = px[1], b = px[2];
+            uint32_t v = (uint32_t)r << 24 | g << 16 | b << 8 | 0xff;
+            int hash;
+
+            if (r == pr && g == pg && b == pb) {
+                if (++run == 62) {
+                    *out++ = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run) {
+                *out++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            hash = QOI_HASH(r, g, b);
+            /* Alpha is part of the match, the index starts out transparent black */
+            if (index[hash] == v) {
+                *out++ = QOI_OP_INDEX | hash;
+            } else {
+                int8_t vr = r - pr;
+                int8_t vg = g - pg;
+                int8_t vb = b - pb;
+                int8_t vg_r = vr - vg;
+                int8_t vg_b = vb - vg;
+
+                index[hash] = v;
+
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    *out++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                    *out++ = QOI_OP_LUMA | (vg + 32);
+                    *out++ = (vg_r + 8) << 4 | (vg_b + 8);
+                } else {
+                    *out++ = QOI_OP_RGB;
+                    *out++ = r;
+                    *out++ = g;
+                    *out++ = b;
+                }
+            }
+
+            pr = r;
+            pg = g;
+            pb = b;
+        }
+
+        if (out > buf && fwrite(buf, 1, out - buf, h->fp) != out - buf)
+            ret = -1;
+    }
+
+    if (run) {
+        uint8_t op = QOI_OP_RUN | (run - 1);
+        fwrite(&op, 1, 1, h->fp);
+    }
+    if (fwrite(padding, 1, sizeof(padding), h->fp) != sizeof(padding))
+        ret = -1;
+
+    picture_release(rgb);
+    free(buf);
+
+    return ret;
+}
+
+int close_file_qoi(handle_t handle)
+{
+    qoi_output_t *h = handle;
+    int ret = 0;
+
+    if (h->fp != stdout)
+        ret = fclose(h->fp);
+    free(h);
+
+    return ret;
+}
@@ -0,0 +1,226 @@
+/*****************************************************************************
+* shm.c: Shared memory ring output driver.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "output.h"
+#include "picture.h"
+#include "output/shmring.h"
+
+#define ALIGN(x) (((x) + SHMRING_ALIGN - 1) & ~(SHMRING_ALIGN - 1))
+
+typedef struct {
+    char name[NAME_MAX + 1];
+    int rgb;
+    int fd;
+    uint8_t *map;
+    size_t size;
+    shm_header_t *hdr;
+    shm_slot_t layout;      /* Plane layout of every slot */
+    uint32_t frame_cnt;
+} shm_output_t;
+
+static int open_file(char *filename, handle_t *handle, int rgb)
+{
+    char dir[PATH_MAX], real[PATH_MAX];
+    char *base = strrchr(filename, '/');
+    uLong crc;
+    shm_output_t *h;
+
+    if ((h = calloc(1, sizeof(*h))) == NULL)
+        return -1;
+
+    /* Runs into different output directories get different rings */
+    snprintf(dir, sizeof(dir), "%.*s", base ? (int)(base - filename) : 1, base ? filename : ".");
+    if (realpath(base == filename ? "/" : dir, real) == NULL)
+        strcpy(real, dir);
+    crc = crc32(0, (const Bytef *)real, strlen(real));
+    snprintf(h->name, sizeof(h->name), "/frameshot.%08lx.%s", crc, base ? base + 1 : filename);
+    h->rgb = rgb;
+    h->fd = -1;
+
+    *handle = h;
+    return 0;
+}
+
+int open_file_shm_rgb(char *filename, handle_t *handle, output_param_t *param)
+{
+    return open_file(filename, handle, 1);
+}
+
+int open_file_shm_yuv(char *filename, handle_t *handle, output_param_t *param)
+{
+    return open_file(filename, handle, 0);
+}
+
+static void wake(shm_output_t *h)
+{
+    syscall(SYS_futex, &h->hdr->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* A ring left over from an earlier run is never resized or written to, a
+ * reader may still have it mapped. Its readers are told it is gone and it
+ * is unlinked, they keep their mapping until they reopen the name. */
+static void retire_ring(shm_output_t *h)
+{
+    shm_output_t old;
+    struct stat sb;
+    int fd;
+
+    if ((fd = shm_open(h->name, O_RDWR, 0)) < 0)
+        return;
+    if (fstat(fd, &sb) == 0 && sb.st_size >= sizeof(shm_header_t)
+        && (old.hdr = mmap(NULL, sizeof(shm_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+        __atomic_store_n(&old.hdr->magic, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&old.hdr->closed, 1, __ATOMIC_RELEASE);
+        wake(&old);
+        munmap(old.hdr, sizeof(shm_header_t));
+    }
+    close(fd);
+    shm_unlink(h->name);
+}
+
+/* The slot size is only known with the first frame */
+static int create_ring(shm_output_t *h, config_t *config)
+{
+    shm_slot_t *l = &h->layout;
+    uint32_t offset = ALIGN(sizeof(shm_slot_t));
+    int i;
+
+    l->csp = h->rgb ? COLORSPACE_RGB : config->csp;
+    l->width = config->crop.width;
+    l->height = config->crop.height;
+    l->plane_cnt = csp_plane_cnt(l->csp);
+    for (i = 0; i < l->plane_cnt; i++) {
+        int row_size, rows;
+        csp_plane_size(l->csp, i, l->width, l->height, &row_size, &rows);
+        l->stride[i] = ALIGN(row_size);
+        l->offset[i] = offset;
+        offset += ALIGN(l->stride[i] * rows);
+    }
+
+    h->size = ALIGN(sizeof(shm_header_t)) + (size_t)SHMRING_SLOTS * offset;
+
+    retire_ring(h);
+
+    /* A new object is all zeroes */
+    if ((h->fd = shm_open(h->name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0
+        || ftruncate(h->fd, h->size)
+        || (h->map = mmap(NULL, h->size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0)) == MAP_FAILED) {
+        perror("shm");
+        if (h->fd >= 0)
+            close(h->fd);
+        h->fd = -1;
+        h->map = NULL;
+        return -1;
+    }
+
+    h->hdr = (shm_header_t *)h->map;
+    h->hdr->version = SHMRING_VERSION;
+    h->hdr->slot_cnt = SHMRING_SLOTS;
+    h->hdr->slot_size = offset;
+    __atomic_store_n(&h->hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+
+    fprintf(stderr, "shm: publishing %ux%u frames to %s\n", l->width, l->height, h->name);
+
+    return 0;
+}
+
+int write_image_shm(handle_t handle, picture_t *pic, config_t *config)
+{
+    shm_output_t *h = handle;
+    uint32_t n = h->frame_cnt + 1;
+    uint8_t *base;
+    shm_slot_t *slot;
+    uint8_t *src[4];
+    int i, y;
+
+    if (h->map == NULL && create_ring(h, config))
+        return -1;
+
+    if (config->crop.width != h->layout.width || config->crop.height != h->layout.height)
+        return -1;
+
+    base = h->map + ALIGN(sizeof(shm_header_t)) + (size_t)((n - 1) % SHMRING_SLOTS) * h->hdr->slot_size;
+    slot = (shm_slot_t *)base;
+
+    __atomic_store_n(&slot->seq, 2 * n - 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (h->rgb) {
+        if (output_scale_rgb(pic, config, base + h->layout.offset[0], h->layout.stride[0]))
+            return -1;
+    } else {
+        picture_crop(pic, config->csp, &config->crop, src);
+        for (i = 0; i < h->layout.plane_cnt; i++) {
+            int row_size, rows;
+            csp_plane_size(config->csp, i, h->layout.width, h->layout.height, &row_size, &rows);
+            for (y = 0; y < rows; y++)
+                memcpy(base + h->layout.offset[i] + y * h->layout.stride[i],
+                       src[i] + y * pic->img.stride[i], row_size);
+        }
+    }
+
+    slot->csp = h->layout.csp;
+    slot->width = h->layout.width;
+    slot->height = h->layout.height;
+    slot->pts = pic->pts;
+    slot->plane_cnt = h->layout.plane_cnt;
+    memcpy(slot->stride, h->layout.stride, sizeof(slot->stride));
+    memcpy(slot->offset, h->layout.offset, sizeof(slot->offset));
+
+    __atomic_store_n(&slot->seq, 2 * n, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->hdr->seq, n, __ATOMIC_RELEASE);
+    wake(h);
+
+    h->frame_cnt = n;
+    return 0;
+}
+
+int close_file_shm(handle_t handle)
+{
+    shm_output_t *h = handle;
+
+    /* The object stays behind for readers still catching up */
+    if (h->map) {
+        __atomic_store_n(&h->hdr->closed, 1, __ATOMIC_RELEASE);
+        wake(h);
+        munmap(h->map, h->size);
+    }
+    if (h->fd >= 0)
+        close(h->fd);
+    free(h);
+
+    return 0;
+}
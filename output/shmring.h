@@ -0,0 +1,78 @@
+/*****************************************************************************
+* shmring.h: Layout of the shared memory frame ring.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+
+/* The ring is a POSIX shared memory object, /frameshot.<dir>.<name> where
+ * dir is the zlib crc32 of the absolute path of the output directory (-o,
+ * symlinks resolved, no trailing slash) as 8 lowercase hex digits, and name
+ * is the file name the output would otherwise have (frames.rgb, frames.yuv,
+ * frames_320w.rgb, ...). frameshot prints the name when it creates the ring.
+ * It is laid out as
+ *
+ *   shm_header_t | slot 0 | slot 1 | ... | slot slot_cnt-1
+ *
+ * with the header padded to SHMRING_ALIGN bytes and each slot slot_size
+ * bytes long. A slot starts with a shm_slot_t and holds the planes of one
+ * frame at the given offsets from the start of the slot.
+ *
+ * The writer never waits. Frame n (counting from 1) goes into slot
+ * (n - 1) % slot_cnt, whose seq is 2n - 1 while it is written and 2n once it
+ * is complete; header seq is then set to n and every futex waiter on it is
+ * woken. A reader waits on header seq with FUTEX_WAIT, uses the frame in
+ * place and checks that the slot seq is still 2n afterwards; if it is not,
+ * the writer has lapped the reader and the frame has to be dropped.
+ *
+ * A new run never reuses the object of an earlier one: it clears magic,
+ * sets closed in the old header and unlinks it before creating a new one
+ * under the same name. A reader that sees either should unmap and reopen
+ * the name. */
+
+#define SHMRING_MAGIC 0x4d485346    /* "FSHM" */
+#define SHMRING_VERSION 1
+#define SHMRING_ALIGN 64
+#define SHMRING_SLOTS 8
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_cnt;
+    uint32_t slot_size;
+    uint32_t seq;           /* frames published, futex word */
+    uint32_t closed;        /* the writer has finished */
+} shm_header_t;
+
+typedef struct {
+    uint32_t seq;
+    int32_t csp;            /* COLORSPACE_* from common.h, with COLORSPACE_HIGH_DEPTH
+                             * the samples are 16-bit little endian, MSB aligned */
+    uint32_t width, height;
+    int64_t pts;
+    int32_t plane_cnt;
+    int32_t stride[4];
+    uint32_t offset[4];
+} shm_slot_t;
+
+#endif
@@ -0,0 +1,210 @@
+/*****************************************************************************
+* yuv.c: YUV4MPEG2 and raw YUV output drivers.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+
+#include "common.h"
+#include "output.h"
+#include "picture.h"
+
+/* All frames go into one file. When a frame is stored uncompressed in the
+ * input and is output whole and unscaled, its bytes are copied file to file
+ * by the kernel instead of from the decoded picture. */
+
+#define COPY_CHUNK (1 << 20)
+
+typedef struct {
+    FILE *fp;
+    int y4m;
+    int header_done;
+} yuv_output_t;
+
+static int open_file(char *filename, handle_t *handle, int y4m)
+{
+    yuv_output_t *h;
+
+    if ((h = calloc(1, sizeof(*h))) == NULL)
+        return -1;
+
+    if (!strcmp(filename, "-"))
+        h->fp = stdout;
+    else if ((h->fp = fopen(filename, "wb")) == NULL) {
+        free(h);
+        return -1;
+    }
+    h->y4m = y4m;
+
+    *handle = h;
+    return 0;
+}
+
+int open_file_yuv4mpeg(char *filename, handle_t *handle, output_param_t *param)
+{
+    return open_file(filename, handle, 1);
+}
+
+int open_file_yuv(char *filename, handle_t *handle, output_param_t *param)
+{
+    return open_file(filename, handle, 0);
+}
+
+static int write_header(yuv_output_t *h, config_t *config)
+{
+    static const char *csp_names[] = {
+        [COLORSPACE_420] = "420jpeg",
+        [COLORSPACE_422] = "422",
+        [COLORSPACE_444] = "444",
+        [COLORSPACE_444A] = "444alpha",
+        [COLORSPACE_400] = "mono",
+    };
+    int csp = config->csp & COLORSPACE_MASK;
+
+    fprintf(h->fp, "YUV4MPEG2 W%u H%u", config->crop.width, config->crop.height);
+    if (config->fps_num && config->fps_den)
+        fprintf(h->fp, " F%d:%d", config->fps_num, config->fps_den);
+    fprintf(h->fp, " I%c", config->interlace ? config->interlace : 'p');
+    if (config->sar_width && config->sar_height)
+        fprintf(h->fp, " A%d:%d", config->sar_width, config->sar_height);
+    if ((config->csp & COLORSPACE_HIGH_DEPTH) && csp == COLORSPACE_400)
+        fprintf(h->fp, " Cmono%d\n", config->bit_depth);
+    else if (config->csp & COLORSPACE_HIGH_DEPTH)
+        fprintf(h->fp, " C%sp%d\n", csp == COLORSPACE_420 ? "420" : csp_names[csp], config->bit_depth);
+    else if (csp == COLORSPACE_420 && config->chroma_siting)
+        fprintf(h->fp, " C%s\n", config->chroma_siting);
+    else
+        fprintf(h->fp, " C%s\n", csp_names[csp]);
+
+    return ferror(h->fp) ? -1 : 0;
+}
+
+/* copy_file_range() when both are files on a filesystem that supports it,
+ * sendfile() when the output is a pipe or on another filesystem, and
+ * read()/write() if neither is available. */
+static int copy_frame(yuv_output_t *h, frame_ref_t *ref)
+{
+    int out = fileno(h->fp);
+    off_t offset = ref->offset;
+    int64_t left = ref->size;
+    ssize_t n;
+    char *buf;
+
+    if (fflush(h->fp))
+        return -1;
+
+    while (left > 0 && (n = copy_file_range(ref->fd, &offset, out, NULL, left, 0)) > 0)
+        left -= n;
+
+    while (left > 0 && (n = sendfile(out, ref->fd, &offset, left)) > 0)
+        left -= n;
+
+    if (left > 0 && (buf = malloc(COPY_CHUNK)) != NULL) {
+        while (left > 0) {
+            n = pread(ref->fd, buf, left < COPY_CHUNK ? left : COPY_CHUNK, offset);
+            if (n <= 0 || write(out, buf, n) != n)
+                break;
+            offset += n;
+            left -= n;
+        }
+        free(buf);
+    }
+
+    return left ? -1 : 0;
+}
+
+static int write_planes(yuv_output_t *h, picture_t *pic, config_t *config)
+{
+    uint8_t *src[4], *row = NULL;
+    int i, y, ret = 0;
+
+    picture_crop(pic, config->csp, &config->crop, src);
+
+    /* High depth samples go back to the source depth, as the input had them */
+    if ((config->csp & COLORSPACE_HIGH_DEPTH) && config->bit_depth < 16
+        && (row = malloc(config->crop.width * 2)) == NULL)
+        return -1;
+
+    for (i = 0; i < csp_plane_cnt(config->csp) && !ret; i++) {
+        int row_size, rows;
+        csp_plane_size(config->csp, i, config->crop.width, config->crop.height, &row_size, &rows);
+        for (y = 0; y < rows && !ret; y++) {
+            uint8_t *p = src[i] + y * pic->img.stride[i];
+            if (row) {
+                samples_lsb_align(row, p, row_size / 2, config->bit_depth);
+                p = row;
+            }
+            if (fwrite(p, 1, row_size, h->fp) != row_size)
+                ret = -1;
+        }
+    }
+
+    free(row);
+
+    return ret;
+}
+
+int write_image_yuv(handle_t handle, picture_t *pic, config_t *config)
+{
+    yuv_output_t *h = handle;
+    rect_t *crop = &config->crop;
+
+    if ((config->csp & COLORSPACE_MASK) >= COLORSPACE_RGB) {
+        fprintf(stderr, "ERROR: YUV output can't be made from RGB\n");
+        return -1;
+    }
+
+    if (h->y4m && !h->header_done) {
+        if (write_header(h, config))
+            return -1;
+        h->header_done = 1;
+    }
+
+    if (h->y4m && fputs("FRAME\n", h->fp) == EOF)
+        return -1;
+
+    if (pic->ref.fd >= 0 && crop->x == 0 && crop->y == 0
+        && crop->width == config->width && crop->height == config->height)
+        return copy_frame(h, &pic->ref);
+
+    return write_planes(h, pic, config);
+}
+
+int close_file_yuv(handle_t handle)
+{
+    yuv_output_t *h = handle;
+    int ret = 0;
+
+    if (h->fp != stdout)
+        ret = fclose(h->fp);
+    else
+        ret = fflush(h->fp);
+    free(h);
+
+    return ret;
+}
@@ -0,0 +1,360 @@
+/*****************************************************************************
+* picture.c: picture allocation.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libavutil/avutil.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#include "common.h"
+#include "picture.h"
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+static const struct {
+    int plane_cnt;
+    int bytes;                  /* per sample in the first plane */
+    int shift_x, shift_y;       /* chroma subsampling */
+    int pix_fmt;
+    int pix_fmt_high;           /* with COLORSPACE_HIGH_DEPTH */
+} csp_tab[] = {
+    [COLORSPACE_420]  = { 3, 1, 1, 1, PIX_FMT_YUV420P,  PIX_FMT_YUV420P16LE },
+    [COLORSPACE_422]  = { 3, 1, 1, 0, PIX_FMT_YUV422P,  PIX_FMT_YUV422P16LE },
+    [COLORSPACE_444]  = { 3, 1, 0, 0, PIX_FMT_YUV444P,  PIX_FMT_YUV444P16LE },
+    [COLORSPACE_444A] = { 4, 1, 0, 0, PIX_FMT_YUVA444P, PIX_FMT_NONE },
+    [COLORSPACE_400]  = { 1, 1, 0, 0, PIX_FMT_GRAY8,    PIX_FMT_GRAY16LE },
+    [COLORSPACE_RGB]  = { 1, 3, 0, 0, PIX_FMT_RGB24,    PIX_FMT_RGB48BE },
+    [COLORSPACE_RGBA] = { 1, 4, 0, 0, PIX_FMT_RGBA,     PIX_FMT_RGBA64BE },
+};
+
+#define CSP(csp) csp_tab[(csp) & COLORSPACE_MASK]
+
+static int csp_bytes(int csp)
+{
+    return CSP(csp).bytes << !!(csp & COLORSPACE_HIGH_DEPTH);
+}
+
+int csp_plane_cnt(int csp)
+{
+    return CSP(csp).plane_cnt;
+}
+
+void csp_plane_size(int csp, int plane, int width, int height, int *row_size, int *rows)
+{
+    /* The alpha plane is full size */
+    int chroma = plane == 1 || plane == 2;
+
+    *row_size = (chroma ? width >> CSP(csp).shift_x : width) * csp_bytes(csp);
+    *rows = chroma ? height >> CSP(csp).shift_y : height;
+}
+
+int csp_pix_fmt(int csp)
+{
+    return csp & COLORSPACE_HIGH_DEPTH ? CSP(csp).pix_fmt_high : CSP(csp).pix_fmt;
+}
+
+/* Plane pointers to the top left corner of crop */
+void picture_crop(picture_t *pic, int csp, rect_t *crop, uint8_t *plane[4])
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        int chroma = i == 1 || i == 2;
+        int x = chroma ? crop->x >> CSP(csp).shift_x : crop->x;
+        int y = chroma ? crop->y >> CSP(csp).shift_y : crop->y;
+
+        if (i >= CSP(csp).plane_cnt) {
+            plane[i] = NULL;
+            continue;
+        }
+        plane[i] = pic->img.plane[i] + y * pic->img.stride[i] + x * csp_bytes(csp);
+    }
+}
+
+/* 16-bit samples of depth bits to MSB aligned, in place. The top bits are
+ * repeated below so the full range maps to the full range. */
+void samples_msb_align(uint8_t *p, int cnt, int depth)
+{
+    int shift = 16 - depth;
+    int i = 0;
+
+    if (shift <= 0)
+        return;
+#ifdef HAVE_SSE2
+    {
+        __m128i l = _mm_cvtsi32_si128(shift), r = _mm_cvtsi32_si128(depth - shift);
+        __m128i mask = _mm_set1_epi16((1 << depth) - 1);
+        for (; i + 8 <= cnt; i += 8) {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((__m128i *)(p + 2 * i)), mask);
+            v = _mm_or_si128(_mm_sll_epi16(v, l), _mm_srl_epi16(v, r));
+            _mm_storeu_si128((__m128i *)(p + 2 * i), v);
+        }
+    }
+#endif
+    for (; i < cnt; i++) {
+        unsigned v = (p[2 * i] | p[2 * i + 1] << 8) & ((1 << depth) - 1);
+        v = (v << shift | v >> (depth - shift)) & 0xffff;
+        p[2 * i] = v;
+        p[2 * i + 1] = v >> 8;
+    }
+}
+
+/* MSB aligned 16-bit samples back to depth bits */
+void samples_lsb_align(uint8_t *dst, const uint8_t *src, int cnt, int depth)
+{
+    int shift = 16 - depth;
+    int i = 0;
+
+#ifdef HAVE_SSE2
+    {
+        __m128i r = _mm_cvtsi32_si128(shift);
+        for (; i + 8 <= cnt; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+            _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_srl_epi16(v, r));
+        }
+    }
+#endif
+    for (; i < cnt; i++) {
+        unsigned v = (src[2 * i] | src[2 * i + 1] << 8) >> shift;
+        dst[2 * i] = v;
+        dst[2 * i + 1] = v >> 8;
+    }
+}
+
+/* MSB aligned 16-bit samples to 8-bit */
+void samples_pack8(uint8_t *dst, const uint8_t *src, int cnt)
+{
+    int i = 0;
+
+#ifdef HAVE_SSE2
+    for (; i + 16 <= cnt; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+        a = _mm_srli_epi16(a, 8);
+        b = _mm_srli_epi16(b, 8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i < cnt; i++)
+        dst[i] = src[2 * i + 1];
+}
+
+int picture_alloc(picture_t *pic, int csp, int width, int height)
+{
+    size_t offset[4], size = 0;
+    uint8_t *buf;
+    int i;
+
+    memset(pic, 0, sizeof(*pic));
+    pic->img.plane_cnt = CSP(csp).plane_cnt;
+
+    for (i = 0; i < pic->img.plane_cnt; i++) {
+        int row_size, rows;
+
+        csp_plane_size(csp, i, width, height, &row_size, &rows);
+        pic->img.stride[i] = ALIGN(row_size, PICTURE_ALIGN);
+        offset[i] = size + PICTURE_GUARD_ROWS * pic->img.stride[i];
+        size += (size_t)pic->img.stride[i] * (rows + 2 * PICTURE_GUARD_ROWS);
+    }
+
+    if (posix_memalign((void **)&buf, PICTURE_ALIGN, size))
+        return -1;
+    memset(buf, 0, size);
+
+    for (i = 0; i < pic->img.plane_cnt; i++)
+        pic->img.plane[i] = buf + offset[i];
+
+    pic->roi.width = width;
+    pic->roi.height = height;
+    pic->ref.fd = -1;
+
+    return 0;
+}
+
+void picture_clean(picture_t *pic)
+{
+    if (pic->img.plane[0])
+        free(pic->img.plane[0] - PICTURE_GUARD_ROWS * pic->img.stride[0]);
+    memset(pic, 0, sizeof(*pic));
+}
+
+/* Pictures are recycled through one pool per geometry, shared by the input,
+ * scaling and output stages. Once every stage has seen a frame no more
+ * allocation happens. */
+
+typedef struct picture_pool_t {
+    int csp, width, height;
+    int free_cnt;
+    picture_t *free[16];
+    struct picture_pool_t *next;
+} picture_pool_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static picture_pool_t *pools;
+
+picture_t *picture_get(int csp, int width, int height)
+{
+    picture_pool_t *pool;
+    picture_t *pic = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    for (pool = pools; pool; pool = pool->next)
+        if (pool->csp == csp && pool->width == width && pool->height == height)
+            break;
+    if (pool == NULL && (pool = calloc(1, sizeof(*pool))) != NULL) {
+        pool->csp = csp;
+        pool->width = width;
+        pool->height = height;
+        pool->next = pools;
+        pools = pool;
+    }
+    if (pool && pool->free_cnt)
+        pic = pool->free[--pool->free_cnt];
+    pthread_mutex_unlock(&pool_lock);
+
+    if (pool == NULL)
+        return NULL;
+
+    if (pic == NULL) {
+        if ((pic = malloc(sizeof(*pic))) == NULL)
+            return NULL;
+        if (picture_alloc(pic, csp, width, height)) {
+            free(pic);
+            return NULL;
+        }
+    }
+
+    pic->pts = 0;
+    pic->roi.x = pic->roi.y = 0;
+    pic->roi.width = width;
+    pic->roi.height = height;
+    pic->ref.fd = -1;
+    pic->pool = pool;
+
+    return pic;
+}
+
+void picture_release(picture_t *pic)
+{
+    picture_pool_t *pool;
+
+    if (!pic)
+        return;
+
+    pool = pic->pool;
+    pthread_mutex_lock(&pool_lock);
+    if (pool->free_cnt < sizeof(pool->free) / sizeof(*pool->free)) {
+        pool->free[pool->free_cnt++] = pic;
+        pic = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (pic) {
+        picture_clean(pic);
+        free(pic);
+    }
+}
+
+/* The cropped region of a high depth picture as a new 8-bit one */
+picture_t *picture_pack8(picture_t *pic, int csp, rect_t *crop)
+{
+    picture_t *out;
+    uint8_t *src[4];
+    int i, y;
+
+    if ((out = picture_get(csp & COLORSPACE_MASK, crop->width, crop->height)) == NULL)
+        return NULL;
+
+    picture_crop(pic, csp, crop, src);
+    for (i = 0; i < CSP(csp).plane_cnt; i++) {
+        int row_size, rows;
+        csp_plane_size(csp, i, crop->width, crop->height, &row_size, &rows);
+        for (y = 0; y < rows; y++)
+            samples_pack8(out->img.plane[i] + y * out->img.stride[i],
+                          src[i] + y * pic->img.stride[i], row_size / 2);
+    }
+
+    return out;
+}
+
+/* The cropped region as a new picture */
+picture_t *picture_copy(picture_t *pic, int csp, rect_t *crop)
+{
+    picture_t *out;
+    uint8_t *src[4];
+    int i, y;
+
+    if ((out = picture_get(csp, crop->width, crop->height)) == NULL)
+        return NULL;
+
+    picture_crop(pic, csp, crop, src);
+    for (i = 0; i < CSP(csp).plane_cnt; i++) {
+        int row_size, rows;
+        csp_plane_size(csp, i, crop->width, crop->height, &row_size, &rows);
+        for (y = 0; y < rows; y++)
+            memcpy(out->img.plane[i] + y * out->img.stride[i], src[i] + y * pic->img.stride[i], row_size);
+    }
+
+    return out;
+}
+
+/* Whether the cropped region of pic has the samples of copy, which is
+ * crop sized */
+int picture_equal(picture_t *pic, int csp, rect_t *crop, picture_t *copy)
+{
+    uint8_t *src[4];
+    int i, y;
+
+    picture_crop(pic, csp, crop, src);
+    for (i = 0; i < CSP(csp).plane_cnt; i++) {
+        int row_size, rows;
+        csp_plane_size(csp, i, crop->width, crop->height, &row_size, &rows);
+        for (y = 0; y < rows; y++)
+            if (memcmp(copy->img.plane[i] + y * copy->img.stride[i], src[i] + y * pic->img.stride[i], row_size))
+                return 0;
+    }
+
+    return 1;
+}
+
+void picture_pool_flush(void)
+{
+    picture_pool_t *pool;
+
+    pthread_mutex_lock(&pool_lock);
+    while ((pool = pools) != NULL) {
+        pools = pool->next;
+        while (pool->free_cnt) {
+            picture_t *pic = pool->free[--pool->free_cnt];
+            picture_clean(pic);
+            free(pic);
+        }
+        free(pool);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,47 @@
+/*****************************************************************************
+* picture.h: picture allocation.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+/* Strides are padded to this, and every plane starts on it */
+#define PICTURE_ALIGN 64
+/* Rows of padding above and below every plane, so kernels may overread */
+#define PICTURE_GUARD_ROWS 2
+
+int csp_plane_cnt(int csp);
+void csp_plane_size(int csp, int plane, int width, int height, int *row_size, int *rows);
+int csp_pix_fmt(int csp);
+
+int picture_alloc(picture_t *pic, int csp, int width, int height);
+void picture_clean(picture_t *pic);
+
+picture_t *picture_get(int csp, int width, int height);
+void picture_release(picture_t *pic);
+void picture_pool_flush(void);
+
+void picture_crop(picture_t *pic, int csp, rect_t *crop, uint8_t *plane[4]);
+picture_t *picture_pack8(picture_t *pic, int csp, rect_t *crop);
+picture_t *picture_copy(picture_t *pic, int csp, rect_t *crop);
+int picture_equal(picture_t *pic, int csp, rect_t *crop, picture_t *copy);
+
+/* Conversions of rows of 16-bit little endian samples */
+void samples_msb_align(uint8_t *p, int cnt, int depth);
+void samples_lsb_align(uint8_t *dst, const uint8_t *src, int cnt, int depth);
+void samples_pack8(uint8_t *dst, const uint8_t *src, int cnt);
@@ -0,0 +1,126 @@
+/*****************************************************************************
+* sheet.c: contact sheet composition.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavutil/avutil.h>
+#include <libswscale/swscale.h>
+
+#include "common.h"
+#include "sheet.h"
+#include "picture.h"
+
+/* Each frame is scaled straight from its YUV planes into its own tile of a
+ * single RGB canvas, which is then written out once. */
+
+struct sheet_t {
+    int csp;
+    rect_t crop;
+    int columns, rows;
+    int tile_width, tile_height;
+    int width, height;
+    picture_t canvas;
+    struct SwsContext *sws;
+};
+
+int sheet_new(sheet_t **sheet, config_t *config, int columns, int tile_width, int tile_cnt)
+{
+    sheet_t *s;
+
+    if ((s = calloc(1, sizeof(*s))) == NULL)
+        return -1;
+
+    s->csp = config->csp;
+    s->crop = config->crop;
+    s->columns = columns < tile_cnt ? columns : tile_cnt;
+    s->rows = (tile_cnt + s->columns - 1) / s->columns;
+    s->tile_width = tile_width < s->crop.width ? tile_width & ~1 : s->crop.width;
+    s->tile_height = ((uint64_t)s->tile_width * s->crop.height / s->crop.width) & ~1;
+    if (s->tile_height < 2)
+        s->tile_height = 2;
+
+    s->width = s->columns * s->tile_width;
+    s->height = s->rows * s->tile_height;
+
+    /* Unused tiles stay black */
+    if (picture_alloc(&s->canvas, COLORSPACE_RGB, s->width, s->height))
+        goto error;
+
+    s->sws = sws_getContext(s->crop.width, s->crop.height, csp_pix_fmt(s->csp),
+                            s->tile_width, s->tile_height, PIX_FMT_RGB24,
+                            SWS_AREA | SWS_ACCURATE_RND, NULL, NULL, NULL);
+    if (s->sws == NULL)
+        goto error;
+
+    *sheet = s;
+    return 0;
+
+error:
+    picture_clean(&s->canvas);
+    free(s);
+    return -1;
+}
+
+int sheet_add(sheet_t *s, picture_t *pic, int index)
+{
+    rect_t *crop = &s->crop;
+    uint8_t *src[4], *dst[4];
+    int dst_stride[4] = { s->canvas.img.stride[0], 0, 0, 0 };
+    int col = index % s->columns;
+    int row = index / s->columns;
+
+    if (row >= s->rows)
+        return -1;
+
+    picture_crop(pic, s->csp, crop, src);
+
+    dst[0] = s->canvas.img.plane[0] + row * s->tile_height * dst_stride[0] + col * s->tile_width * 3;
+    dst[1] = dst[2] = dst[3] = NULL;
+
+    sws_scale(s->sws, src, pic->img.stride, 0, crop->height, dst, dst_stride);
+
+    __asm__ volatile ("emms\n\t");
+
+    return 0;
+}
+
+/* Describe the canvas as an RGB picture for the output driver */
+void sheet_picture(sheet_t *s, picture_t *pic, config_t *config)
+{
+    *pic = s->canvas;
+
+    config->csp = COLORSPACE_RGB;
+    config->width = config->crop.width = s->width;
+    config->height = config->crop.height = s->height;
+    config->crop.x = config->crop.y = 0;
+    pic->roi = config->crop;
+}
+
+void sheet_free(sheet_t *s)
+{
+    if (!s)
+        return;
+    sws_freeContext(s->sws);
+    picture_clean(&s->canvas);
+    free(s);
+}
@@ -0,0 +1,30 @@
+/*****************************************************************************
+* sheet.h: contact sheet composition.
+*****************************************************************************
+* Copyright (C) 2009
+*
+* Authors: Nathan Caldwell <saintdev@gmail.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+*****************************************************************************/
+
+#define SHEET_TILE_WIDTH 320
+
+typedef struct sheet_t sheet_t;
+
+int sheet_new(sheet_t **sheet, config_t *config, int columns, int tile_width, int tile_cnt);
+int sheet_add(sheet_t *sheet, picture_t *pic, int index);
+void sheet_picture(sheet_t *sheet, picture_t *pic, config_t *config);
+void sheet_free(sheet_t *sheet);